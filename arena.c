@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Bump allocator for per-request results.  Blocks double in size as
+ * they are needed and are kept across arena_reset(), so a server
+ * answering many requests settles on the memory its largest one used.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "dict.h"
+
+#define ARENA_BLOCK	4096
+#define ARENA_ALIGN	16
+
+struct arena_block {
+	TAILQ_ENTRY(arena_block) b_entry;
+	size_t			 b_size;
+	size_t			 b_used;
+};
+TAILQ_HEAD(arena_block_list, arena_block);
+
+#define ARENA_HDR \
+	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct dc_arena {
+	struct arena_block_list	 a_blocks;
+	struct arena_block	*a_cur;
+};
+
+struct dc_arena *
+arena_create(void)
+{
+	struct dc_arena *a;
+
+	if ((a = calloc(1, sizeof(*a))) == NULL)
+		return NULL;
+	TAILQ_INIT(&a->a_blocks);
+	return a;
+}
+
+void *
+arena_alloc(struct dc_arena *a, size_t len)
+{
+	struct arena_block *b = a->a_cur;
+	size_t size;
+	void *p;
+
+	len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	while (b != NULL && b->b_size - b->b_used < len) {
+		if ((b = TAILQ_NEXT(b, b_entry)) != NULL)
+			b->b_used = 0;
+	}
+	if (b == NULL) {
+		size = ARENA_BLOCK;
+		if ((b = TAILQ_LAST(&a->a_blocks, arena_block_list)) != NULL)
+			size = b->b_size * 2;
+		size = MAXIMUM(size, len);
+		if ((b = malloc(ARENA_HDR + size)) == NULL)
+			return NULL;
+		b->b_size = size;
+		b->b_used = 0;
+		TAILQ_INSERT_TAIL(&a->a_blocks, b, b_entry);
+	}
+	a->a_cur = b;
+	p = (char *)b + ARENA_HDR + b->b_used;
+	b->b_used += len;
+	return p;
+}
+
+/*
+ * Release everything allocated so far, keeping the blocks.
+ */
+void
+arena_reset(struct dc_arena *a)
+{
+	if ((a->a_cur = TAILQ_FIRST(&a->a_blocks)) != NULL)
+		a->a_cur->b_used = 0;
+}
+
+void
+arena_destroy(struct dc_arena *a)
+{
+	struct arena_block *b;
+
+	if (a == NULL)
+		return;
+	while ((b = TAILQ_FIRST(&a->a_blocks)) != NULL) {
+		TAILQ_REMOVE(&a->a_blocks, b, b_entry);
+		free(b);
+	}
+	free(a);
+}
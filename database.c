@@ -60,6 +60,7 @@
 */
 
 #include <sys/mman.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 
@@ -75,6 +76,7 @@
 
 #include "dict.h"
 #include "database.h"
+#include "pool.h"
 
 /* gzip flag byte */
 #define ASCII_FLAG   0x01 /* bit 0 set: file probably ascii text */
@@ -84,53 +86,656 @@
 #define COMMENT      0x10 /* bit 4 set: file comment present */
 #define RESERVED     0xE0 /* bits 5..7: reserved */
 
+#define CACHE_DEFAULT	8	/* inflated chunks kept per database */
+#define WRITE_IOV	64	/* iovecs per writev(2) */
+#define SCHED_WINDOW	64	/* chunks inflated per round of a batch */
+
+struct gz_chunk {
+	size_t			 c_chunk;	/* chunk number */
+	size_t			 c_len;		/* inflated length */
+	char			*c_buf;		/* ra_clen bytes */
+	u_int			 c_refs;	/* pending writes, see gz_add() */
+	TAILQ_ENTRY(gz_chunk)	 c_entry;
+};
+TAILQ_HEAD(gz_chunk_list, gz_chunk);
+
+/*
+ * Everything needed to inflate chunks.  Each thread brings its own, the
+ * stream below is left untouched once opened.
+ */
+struct dc_decoder {
+	const struct gz_codec	*d_codec;
+	z_stream		 d_stream;	/* libz stream */
+	u_char			*d_window;	/* for inflateBack() */
+	struct gz_chunk_list	 d_lru;		/* most recently used first */
+	size_t			 d_count;
+	size_t			 d_max;
+	u_int64_t		 d_hits;
+	u_int64_t		 d_misses;
+};
+
+/*
+ * A way of inflating a whole chunk.  Dictzip chunks end in a full flush
+ * rather than a final block, so a codec has to stop at the end of the
+ * input and report what it has.
+ */
+struct gz_codec {
+	const char	*name;
+	int		(*init)(struct dc_decoder *);
+	int		(*chunk)(struct dc_decoder *, const u_char *, size_t,
+			    char *, size_t, size_t *);
+	void		(*end)(struct dc_decoder *);
+};
+
 typedef
 struct gz_stream {
 	int		 z_eof;		/* set if end of input file */
-	z_stream	 z_stream;	/* libz stream */
+	int		 z_plain;	/* not compressed */
 	u_char		*z_buf;		/* i/o buffer */
 	size_t		 z_buflen;
+	u_char		*z_next;	/* header parser position */
+	size_t		 z_avail;
 	u_int32_t	 z_hlen;	/* length of the gz header */
-	u_int16_t	 ra_clen;
-	u_int16_t	 ra_ccount;
+	size_t		 z_len;		/* inflated length */
+	size_t		 ra_clen;	/* the same in every member */
+	size_t		 ra_ccount;	/* over all members */
+	u_int		 ra_tables;	/* RA fields seen */
 	u_int16_t	*ra_chunks;
-	u_int64_t	*ra_offset;
-	char		*o_buf;		/* to keep a single ra_clen buffer */
+	u_int64_t	*ra_offset;	/* in the file */
+	size_t		 c_max;		/* cache size of new decoders */
+	const struct gz_codec *codec;
+	const char	*z_text;	/* all of it, if at hand */
+	size_t		 z_textlen;
+	void		*z_map;		/* owned mapping holding z_text */
+	size_t		 z_maplen;
+	struct dc_decoder *dec;		/* for database_lookup() */
+	struct dc_decoder **pool_dec;	/* one per pool worker */
+	u_int		 npool_dec;
 } gz_stream;
 
+struct lookup_job {
+	struct dc_database	*db;
+	struct dc_lookup	**reqs;
+};
+
+/* chunks inflated together, see gz_inflate_pool() */
+struct inflate_job {
+	gz_stream		*s;
+	struct gz_chunk		**chunks;
+};
+
+/* a window of a batch and the chunks it covers, in ascending order */
+struct sched_job {
+	gz_stream		*s;
+	struct dc_lookup	**reqs;
+	struct gz_chunk		**chunks;
+	size_t			*nums;		/* their chunk numbers */
+	size_t			 nchunks;
+};
+
+struct gz_writer {
+	int		 w_fd;
+	int		 w_n;
+	struct iovec	 w_iov[WRITE_IOV];
+	struct gz_chunk	*w_pin[WRITE_IOV];	/* chunk behind each iovec */
+};
+
 static const u_char gz_magic[2] = {0x1f, 0x8b}; /* gzip magic header */
 
+static int zs_init(struct dc_decoder *);
+static int zs_chunk(struct dc_decoder *, const u_char *, size_t, char *,
+    size_t, size_t *);
+static void zs_end(struct dc_decoder *);
+static int zb_init(struct dc_decoder *);
+static int zb_chunk(struct dc_decoder *, const u_char *, size_t, char *,
+    size_t, size_t *);
+static void zb_end(struct dc_decoder *);
+
+static const struct gz_codec gz_codecs[] = {
+	{ "inflate",	 zs_init, zs_chunk, zs_end },
+	{ "inflateback", zb_init, zb_chunk, zb_end },
+};
+#define NCODECS	(sizeof(gz_codecs) / sizeof(gz_codecs[0]))
+
+/* for databases opened from now on, see database_codec() */
+static const struct gz_codec *gz_codec = &gz_codecs[0];
+
 static u_int16_t get_int16(gz_stream *);
 static int get_header(gz_stream *);
 static int get_byte(gz_stream *);
-static void *gz_ropen(char *);
-static int gz_read(void *, size_t, char *, size_t);
+static int gz_members(gz_stream *);
+static void *gz_ropen(char *, struct dc_ident *);
+static struct dc_decoder *decoder_open(gz_stream *);
+static void decoder_resize(struct dc_decoder *, size_t);
+static int gz_inflate(gz_stream *, struct dc_decoder *, size_t,
+    struct gz_chunk *);
+static struct gz_chunk *gz_chunk_get(gz_stream *, struct dc_decoder *,
+    size_t);
+static int gz_pieces(gz_stream *, struct dc_decoder *, size_t, size_t,
+    dc_text_fn, void *);
+static int gz_read(gz_stream *, struct dc_decoder *, size_t, char *, size_t);
+static int gz_pool_decoders(gz_stream *, struct dc_pool *);
+static struct gz_chunk *gz_cached(struct dc_decoder *, size_t);
+static int gz_inflate_pool(gz_stream *, struct dc_pool *, struct gz_chunk **,
+    size_t);
+static int gz_prefetch(gz_stream *, struct dc_pool *, struct dc_index_entry *,
+    size_t);
+static int gz_flush(struct gz_writer *);
+static int gz_add(struct gz_writer *, const void *, size_t, struct gz_chunk *);
 static int gz_close(void *);
 
+/*
+ * Select the codec of the databases opened from now on by name.
+ */
+int
+database_codec(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NCODECS; i++)
+		if (strcmp(name, gz_codecs[i].name) == 0) {
+			gz_codec = &gz_codecs[i];
+			return 0;
+		}
+	errno = EINVAL;
+	return -1;
+}
+
 int
 database_open(char *path, struct dc_database *db)
 {
 	gz_stream *s;
-	if((s = gz_ropen(path)) == NULL)
+	if((s = gz_ropen(path, &db->ident)) == NULL)
 		return -1;
 
 	db->data = s;
-	db->size = s->ra_clen * s->ra_ccount;
+	if (s->z_plain)
+		db->size = s->z_buflen;
+	else
+		db->size = s->z_len;
 
 	return 0;
 }
 
 int
+database_close(struct dc_database *db)
+{
+	int r;
+
+	r = gz_close(db->data);
+	db->data = NULL;
+	return r;
+}
+
+/*
+ * Not thread safe, uses the decoder of the database.
+ */
+ssize_t
 database_lookup(struct dc_index_entry *req, struct dc_database *db, char *out)
 {
-	if (gz_read(db->data, req->def_off, out, req->def_len) == -1)
+	gz_stream *s = db->data;
+
+	return database_lookup_r(req, db, s->dec, out);
+}
+
+ssize_t
+database_lookup_r(struct dc_index_entry *req, struct dc_database *db,
+    struct dc_decoder *d, char *out)
+{
+	if (gz_read(db->data, d, req->def_off, out, req->def_len) == -1)
 		return -1;
 
 	return req->def_len;
 }
 
+/*
+ * Hand the definition of req to fn piece by piece, straight from the
+ * inflated chunks.  A piece is only valid during the call.  Not thread
+ * safe, uses the decoder of the database.
+ */
+int
+database_read(struct dc_index_entry *req, struct dc_database *db,
+    dc_text_fn fn, void *arg)
+{
+	gz_stream *s = db->data;
+
+	return gz_pieces(s, s->dec, req->def_off, req->def_len, fn, arg);
+}
+
+/*
+ * Write the definitions in l to fd, each preceded by prefix.  The iovecs
+ * point into the inflated chunks, or the mapping of an uncompressed
+ * database, and the chunks stay pinned in the cache until written.
+ * With a pool, the chunks ahead are inflated on it a cache full at a
+ * time.  Not thread safe, uses the decoder of the database.
+ */
+int
+database_write(int fd, struct dc_database *db, struct dc_index_list *l,
+    const char *prefix, struct dc_pool *pool)
+{
+	gz_stream *s = db->data;
+	struct dc_index_entry *e;
+	struct gz_writer w;
+	struct gz_chunk *c;
+	size_t chunk, off, len, n;
+	int r = -1;
+
+	if (pool != NULL && pool_size(pool) < 2)
+		pool = NULL;
+
+	w.w_fd = fd;
+	w.w_n = 0;
+	SLIST_FOREACH(e, l, entries) {
+		if (gz_add(&w, prefix, strlen(prefix), NULL) == -1)
+			goto done;
+		if (s->z_text != NULL) {
+			if (e->def_off > s->z_textlen ||
+			    e->def_len > s->z_textlen - e->def_off) {
+				errno = EINVAL;
+				goto done;
+			}
+			if (gz_add(&w, s->z_text + e->def_off, e->def_len,
+			    NULL) == -1)
+				goto done;
+			continue;
+		}
+
+		chunk = e->def_off / s->ra_clen;
+		off = e->def_off % s->ra_clen;
+		for (len = e->def_len; len > 0; len -= n, chunk++, off = 0) {
+			if (chunk >= s->ra_ccount) {
+				errno = EINVAL;
+				goto done;
+			}
+			if (pool != NULL && gz_cached(s->dec, chunk) == NULL) {
+				if (gz_flush(&w) == -1 ||
+				    gz_prefetch(s, pool, e, chunk) == -1)
+					goto done;
+			}
+			/* every cached chunk is pinned, write them out */
+			if ((c = gz_chunk_get(s, s->dec, chunk)) == NULL &&
+			    errno == EBUSY) {
+				if (gz_flush(&w) == -1)
+					goto done;
+				c = gz_chunk_get(s, s->dec, chunk);
+			}
+			if (c == NULL)
+				goto done;
+			if (off >= c->c_len) {
+				errno = EINVAL;
+				goto done;
+			}
+			n = MINIMUM(len, c->c_len - off);
+			if (gz_add(&w, c->c_buf + off, n, c) == -1)
+				goto done;
+		}
+	}
+	r = 0;
+ done:
+	if (gz_flush(&w) == -1)
+		r = -1;
+	return r;
+}
+
+/*
+ * The gzip header of the first member including its chunk table.
+ */
+const void *
+database_header(struct dc_database *db, size_t *len)
+{
+	gz_stream *s = db->data;
+
+	*len = s->z_hlen;
+	return s->z_buf;
+}
+
+struct dc_decoder *
+database_decoder(struct dc_database *db)
+{
+	return decoder_open(db->data);
+}
+
+void
+database_decoder_free(struct dc_decoder *d)
+{
+	if (d == NULL)
+		return;
+	decoder_resize(d, 0);
+	d->d_codec->end(d);
+	free(d);
+}
+
+static void
+database_lookup_work(void *arg, size_t start, size_t end, u_int worker)
+{
+	struct lookup_job *job = arg;
+	gz_stream *s = job->db->data;
+	struct dc_lookup *l;
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		l = job->reqs[i];
+		l->len = database_lookup_r(l->req, job->db,
+		    s->pool_dec[worker], l->out);
+	}
+}
+
+static void
+database_sched_work(void *arg, size_t start, size_t end, u_int worker)
+{
+	struct sched_job *job = arg;
+	gz_stream *s = job->s;
+	struct dc_lookup *l;
+	struct gz_chunk *c;
+	size_t i, k, lo, hi, chunk, off, len, n;
+	char *out;
+
+	for (i = start; i < end; i++) {
+		l = job->reqs[i];
+		if (l->len == -1)
+			continue;
+		chunk = l->req->def_off / s->ra_clen;
+		off = l->req->def_off % s->ra_clen;
+		out = l->out;
+
+		/* the window holds every chunk from here on */
+		for (lo = 0, hi = job->nchunks; lo < hi; ) {
+			k = lo + (hi - lo) / 2;
+			if (job->nums[k] < chunk)
+				lo = k + 1;
+			else
+				hi = k;
+		}
+		for (k = lo, len = l->req->def_len; len > 0;
+		    len -= n, k++, chunk++, off = 0) {
+			if (k >= job->nchunks || job->nums[k] != chunk ||
+			    (c = job->chunks[k])->c_chunk != chunk ||
+			    off >= c->c_len) {
+				l->len = -1;
+				break;
+			}
+			n = MINIMUM(len, c->c_len - off);
+			memcpy(out, c->c_buf + off, n);
+			out += n;
+		}
+		if (len == 0)
+			l->len = l->req->def_len;
+	}
+}
+
+/*
+ * Look up n requests on the pool.  The requests are taken in windows
+ * covering up to SCHED_WINDOW chunks, whose chunks are first inflated
+ * concurrently, each into a buffer of its own, and then copied out.
+ * A chunk is inflated once per window however many requests share it,
+ * so requests should be sorted by def_off; a request going backwards
+ * starts a new window.  The decoders are kept with the database, so at
+ * most one pool may work on a database at a time.
+ */
+int
+database_lookup_pool(struct dc_database *db, struct dc_pool *pool,
+    struct dc_lookup **reqs, size_t n)
+{
+	gz_stream *s = db->data;
+	struct lookup_job job;
+	struct sched_job sj;
+	struct gz_chunk *cs = NULL, **cp = NULL;
+	size_t *nums = NULL;
+	struct dc_index_entry *e;
+	char *bufs = NULL;
+	size_t i, j, k, first, last, next, need, max = 0, pieces, prev;
+	int r = -1;
+
+	if (gz_pool_decoders(s, pool) == -1)
+		return -1;
+
+	if (s->z_text != NULL) {
+		job.db = db;
+		job.reqs = reqs;
+		pool_run(pool, database_lookup_work, &job, n);
+		return 0;
+	}
+
+	for (i = 0; i < n; i = j) {
+		/* count the chunks of the window, next is the first new one */
+		need = 0;
+		pieces = 0;
+		next = 0;
+		prev = 0;
+		for (j = i; j < n; j++) {
+			e = reqs[j]->req;
+			if (e->def_off < prev)
+				break;
+			prev = e->def_off;
+			reqs[j]->len = 0;
+			if (e->def_len == 0)
+				continue;
+			first = e->def_off / s->ra_clen;
+			if (e->def_len - 1 > SIZE_MAX - e->def_off ||
+			    (last = (e->def_off + e->def_len - 1) /
+			    s->ra_clen) >= s->ra_ccount) {
+				reqs[j]->len = -1;
+				continue;
+			}
+			k = last + 1 - MAXIMUM(first, next);
+			if (last < next)
+				k = 0;
+			if (j > i && need + k > SCHED_WINDOW)
+				break;
+			need += k;
+			pieces += last + 1 - first;
+			next = MAXIMUM(next, last + 1);
+		}
+
+		if (need > max) {
+			free(cs);
+			free(cp);
+			free(nums);
+			free(bufs);
+			cs = calloc(need, sizeof(*cs));
+			cp = calloc(need, sizeof(*cp));
+			nums = calloc(need, sizeof(*nums));
+			bufs = reallocarray(NULL, need, s->ra_clen);
+			if (cs == NULL || cp == NULL || nums == NULL ||
+			    bufs == NULL)
+				goto done;
+			max = need;
+		}
+
+		/* list the chunks again, now that they fit */
+		for (k = 0, next = 0, prev = i; prev < j; prev++) {
+			e = reqs[prev]->req;
+			if (reqs[prev]->len == -1 || e->def_len == 0)
+				continue;
+			first = MAXIMUM(e->def_off / s->ra_clen, next);
+			last = (e->def_off + e->def_len - 1) / s->ra_clen;
+			for (; first <= last; first++, k++) {
+				cp[k] = &cs[k];
+				cs[k].c_chunk = nums[k] = first;
+				cs[k].c_buf = bufs + k * s->ra_clen;
+			}
+			next = MAXIMUM(next, last + 1);
+		}
+
+		if (gz_inflate_pool(s, pool, cp, need) == -1)
+			goto done;
+		s->dec->d_misses += need;
+		s->dec->d_hits += pieces - need;
+
+		sj.s = s;
+		sj.reqs = reqs + i;
+		sj.chunks = cp;
+		sj.nums = nums;
+		sj.nchunks = need;
+		pool_run(pool, database_sched_work, &sj, j - i);
+	}
+	r = 0;
+ done:
+	free(cs);
+	free(cp);
+	free(nums);
+	free(bufs);
+	return r;
+}
+
+/*
+ * The whole text of the database, inflated on the pool into an
+ * anonymous mapping that lives as long as the database.  The text of
+ * an uncompressed database is its mapping.  Once inflated, lookups
+ * copy from the text instead of inflating.
+ */
+const char *
+database_text(struct dc_database *db, struct dc_pool *pool, size_t *len)
+{
+	gz_stream *s = db->data;
+	struct gz_chunk *cs = NULL, **cp = NULL;
+	size_t i, n = s->ra_ccount;
+	char *text = MAP_FAILED;
+
+	if (s->z_text != NULL || n == 0) {
+		*len = s->z_textlen;
+		return s->z_text != NULL ? s->z_text : "";
+	}
+
+	if ((cs = calloc(n, sizeof(*cs))) == NULL ||
+	    (cp = calloc(n, sizeof(*cp))) == NULL)
+		goto fail;
+	text = mmap(NULL, n * s->ra_clen, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (text == MAP_FAILED)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		cs[i].c_chunk = i;
+		cs[i].c_buf = text + i * s->ra_clen;
+		cp[i] = &cs[i];
+	}
+	if (gz_inflate_pool(s, pool, cp, n) == -1)
+		goto fail;
+
+	/* only the last chunk may come up short */
+	for (i = 0; i < n; i++) {
+		if (cs[i].c_chunk == SIZE_MAX ||
+		    (i < n - 1 && cs[i].c_len != s->ra_clen)) {
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+	if (mprotect(text, n * s->ra_clen, PROT_READ) == -1)
+		goto fail;
+
+	s->z_text = text;
+	s->z_textlen = (n - 1) * s->ra_clen + cs[n - 1].c_len;
+	s->z_map = text;
+	s->z_maplen = n * s->ra_clen;
+	free(cs);
+	free(cp);
+	*len = s->z_textlen;
+	return s->z_text;
+
+ fail:
+	if (text != MAP_FAILED)
+		munmap(text, n * s->ra_clen);
+	free(cs);
+	free(cp);
+	return NULL;
+}
+
+/*
+ * Take the len bytes at off in the mapping map as the text of the
+ * database, say from a file that database_text() was saved to.  The
+ * mapping is unmapped with the database.
+ */
+int
+database_text_map(struct dc_database *db, void *map, size_t maplen,
+    size_t off, size_t len)
+{
+	gz_stream *s = db->data;
+
+	if (s->z_text != NULL || off > maplen || len > maplen - off ||
+	    len > (size_t)db->size || len + s->ra_clen <= (size_t)db->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	s->z_text = (char *)map + off;
+	s->z_textlen = len;
+	s->z_map = map;
+	s->z_maplen = maplen;
+	return 0;
+}
+
+int
+database_compressed(struct dc_database *db)
+{
+	gz_stream *s = db->data;
+
+	return !s->z_plain;
+}
+
+/*
+ * Keep up to max inflated chunks around per decoder.  A size of 0 is
+ * treated as 1, the chunk being read needs a buffer anyway.
+ */
+void
+database_cache(struct dc_database *db, size_t max)
+{
+	gz_stream *s = db->data;
+	u_int i;
+
+	s->c_max = MAXIMUM(max, 1);
+	decoder_resize(s->dec, s->c_max);
+	for (i = 0; i < s->npool_dec; i++)
+		decoder_resize(s->pool_dec[i], s->c_max);
+}
+
+void
+database_stats(struct dc_database *db, u_int64_t *hits, u_int64_t *misses)
+{
+	gz_stream *s = db->data;
+	u_int i;
+
+	*hits = s->dec->d_hits;
+	*misses = s->dec->d_misses;
+	for (i = 0; i < s->npool_dec; i++) {
+		*hits += s->pool_dec[i]->d_hits;
+		*misses += s->pool_dec[i]->d_misses;
+	}
+}
+
+static struct dc_decoder *
+decoder_open(gz_stream *s)
+{
+	struct dc_decoder *d;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return NULL;
+	TAILQ_INIT(&d->d_lru);
+	d->d_max = s->c_max;
+	d->d_codec = s->codec;
+	if (d->d_codec->init(d) == -1) {
+		free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+static void
+decoder_resize(struct dc_decoder *d, size_t max)
+{
+	struct gz_chunk *c;
+
+	d->d_max = max;
+	while (d->d_count > d->d_max) {
+		c = TAILQ_LAST(&d->d_lru, gz_chunk_list);
+		TAILQ_REMOVE(&d->d_lru, c, c_entry);
+		free(c->c_buf);
+		free(c);
+		d->d_count--;
+	}
+}
+
 static void *
-gz_ropen(char *path)
+gz_ropen(char *path, struct dc_ident *id)
 {
 	struct stat sb;
 	gz_stream *s;
@@ -138,25 +743,38 @@ gz_ropen(char *path)
 
 	if ((s = calloc(1, sizeof(gz_stream))) == NULL)
 		return NULL;
-
-	if (inflateInit2(&(s->z_stream), -MAX_WBITS) != Z_OK)
-		goto fail1;
+	s->c_max = CACHE_DEFAULT;
+	s->codec = gz_codec;
 
 	if ((fd = open(path, O_RDONLY)) == -1)
 		goto fail1;
 	if (fstat(fd, &sb) == -1)
 		goto fail2;
 	s->z_buflen = sb.st_size;
+	id->dev = sb.st_dev;
+	id->ino = sb.st_ino;
+	id->size = sb.st_size;
+	id->mtime = sb.st_mtim;
 
 	s->z_buf = mmap(NULL, s->z_buflen, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (s->z_buf == MAP_FAILED)
 		goto fail2;
 
-	s->z_stream.avail_in = s->z_buflen;
-	s->z_stream.next_in = s->z_buf;
+	s->z_avail = s->z_buflen;
+	s->z_next = s->z_buf;
+
+	/* without the gzip magic this is a plain .dict */
+	if (s->z_buflen < sizeof(gz_magic) ||
+	    memcmp(s->z_buf, gz_magic, sizeof(gz_magic)) != 0)
+		s->z_plain = 1;
 
 	/* read the .gz header */
-	if (get_header(s) != 0 || (s->o_buf = malloc(65535)) == NULL) {
+	if (s->z_plain) {
+		s->z_text = (char *)s->z_buf;
+		s->z_textlen = s->z_buflen;
+	}
+	if ((!s->z_plain && gz_members(s) != 0) ||
+	    (s->dec = decoder_open(s)) == NULL) {
 		gz_close(s);
 		return NULL;
 	}
@@ -173,12 +791,12 @@ gz_ropen(char *path)
 static int
 get_byte(gz_stream *s)
 {
-	if (s->z_stream.avail_in == 0) {
+	if (s->z_avail == 0) {
 		s->z_eof = 1;
 		return EOF;
 	}
-	s->z_stream.avail_in--;
-	return *s->z_stream.next_in++;
+	s->z_avail--;
+	return *s->z_next++;
 }
 
 static u_int16_t
@@ -191,10 +809,15 @@ get_int16(gz_stream *s)
 	return x;
 }
 
+/*
+ * Append the chunks of this member to the table, with offsets from the
+ * start of its deflate data.  gz_members() makes them absolute.
+ */
 static int
 get_header_extra_RA(gz_stream *s, int slen)
 {
-	u_int64_t offset = 0;
+	u_int16_t *chunks;
+	u_int64_t *offsets, offset = 0;
 	int ver, clen, ccount, chunk, i;
 
 	if (slen < 6)
@@ -205,24 +828,31 @@ get_header_extra_RA(gz_stream *s, int slen)
 	ccount = get_int16(s);
 	slen -= 6;
 
-	if (ver != 1 || clen < 0 || ccount < 0 || 2 *  ccount != slen)
+	if (ver != 1 || clen <= 0 || ccount < 0 || 2 *  ccount != slen)
+		return -1;
+	if (s->ra_clen != 0 && s->ra_clen != (size_t)clen)
 		return -1;
 
 	s->ra_clen = clen;
-	s->ra_ccount = ccount;
-	if ((s->ra_chunks = malloc(sizeof(u_int16_t) * ccount)) == NULL)
+	if ((chunks = reallocarray(s->ra_chunks, s->ra_ccount + ccount,
+	    sizeof(*chunks))) == NULL)
 		return -1;
-	if ((s->ra_offset = malloc(sizeof(u_int64_t) * ccount)) == NULL)
+	s->ra_chunks = chunks;
+	if ((offsets = reallocarray(s->ra_offset, s->ra_ccount + ccount,
+	    sizeof(*offsets))) == NULL)
 		return -1;
+	s->ra_offset = offsets;
 
 	for (i = 0; i < ccount; i++) {
 		chunk = get_int16(s);
 		if (chunk < 0)
 			return -1;
-		s->ra_chunks[i] = chunk;
-		s->ra_offset[i] = offset;
+		chunks[s->ra_ccount + i] = chunk;
+		offsets[s->ra_ccount + i] = offset;
 		offset += chunk;
 	}
+	s->ra_ccount += ccount;
+	s->ra_tables++;
 
 	return 0;
 }
@@ -329,83 +959,572 @@ get_header(gz_stream *s)
 	return 0;
 }
 
+/*
+ * Read the header of every gzip member and join their chunk tables
+ * into one.  Chunk n then holds the text at n * ra_clen whichever
+ * member it is in, so every member but the last has to inflate to
+ * whole chunks, which its ISIZE tells.
+ */
 static int
-gz_read(void *cookie, size_t off, char *out, size_t len)
+gz_members(gz_stream *s)
 {
-	gz_stream *s = (gz_stream*)cookie;
-	size_t chunk, z_off, cpylen;
-	int error = Z_OK;
+	const u_char *t;
+	u_int64_t pos = 0, end;
+	u_int32_t hlen = 0, isize, missing;
+	size_t first, n, len, i;
+	int whole;
+
+	for (;;) {
+		s->z_next = s->z_buf + pos;
+		s->z_avail = s->z_buflen - pos;
+		s->z_hlen = 0;
+		first = s->ra_ccount;
+		i = s->ra_tables;
+		if (get_header(s) != 0 || s->ra_tables != i + 1) {
+			errno = EFTYPE;
+			return -1;
+		}
+		if (pos == 0)
+			hlen = s->z_hlen;
+
+		end = pos + s->z_hlen;
+		for (i = first; i < s->ra_ccount; i++)
+			s->ra_offset[i] += end;
+		n = s->ra_ccount - first;
+		if (n > 0)
+			end = s->ra_offset[s->ra_ccount - 1] +
+			    s->ra_chunks[s->ra_ccount - 1];
+
+		/* the trailer holds the inflated length modulo 2^32 */
+		len = n * s->ra_clen;
+		whole = 0;
+		if (end + 8 <= s->z_buflen) {
+			t = s->z_buf + end + 4;
+			isize = t[0] | t[1] << 8 | t[2] << 16 |
+			    (u_int32_t)t[3] << 24;
+			missing = (u_int32_t)len - isize;
+			if (missing < s->ra_clen) {
+				whole = missing == 0;
+				len -= missing;
+			}
+		}
+		pos = end + 8;
+		if (pos + sizeof(gz_magic) > s->z_buflen ||
+		    memcmp(s->z_buf + pos, gz_magic, sizeof(gz_magic)) != 0) {
+			s->z_len += len;
+			break;
+		}
+		if (!whole) {
+			errno = EFTYPE;
+			return -1;
+		}
+		s->z_len += len;
+	}
+	s->z_hlen = hlen;
 
-	chunk = off / s->ra_clen;
-	off = off % s->ra_clen;
+	return 0;
+}
 
- again:
-	if (chunk >= s->ra_ccount)
-		return -1;
-	z_off = s->z_hlen + s->ra_offset[chunk];
+/*
+ * Dictzip chunks are flushed with Z_FULL_FLUSH, so each one can be
+ * inflated on its own.  Every chunk but the last holds ra_clen bytes
+ * of the text, the codec has to produce exactly that many.
+ */
+static int
+gz_inflate(gz_stream *s, struct dc_decoder *d, size_t chunk,
+    struct gz_chunk *c)
+{
+	size_t z_off, want;
+
+	z_off = s->ra_offset[chunk];
 	if (s->z_buflen < z_off + s->ra_chunks[chunk])
 		return -1;
+	if (s->z_len <= chunk * s->ra_clen) {
+		errno = EFTYPE;
+		return -1;
+	}
+	want = MINIMUM(s->ra_clen, s->z_len - chunk * s->ra_clen);
+	if (d->d_codec->chunk(d, s->z_buf + z_off, s->ra_chunks[chunk],
+	    c->c_buf, want, &c->c_len) == -1)
+		return -1;
+
+	c->c_chunk = chunk;
+	return 0;
+}
+
+static int
+zs_init(struct dc_decoder *d)
+{
+	if (inflateInit2(&d->d_stream, -MAX_WBITS) != Z_OK)
+		return -1;
+	return 0;
+}
 
-	s->z_stream.next_in = s->z_buf + z_off;
-	s->z_stream.avail_in = s->ra_chunks[chunk];
-	s->z_stream.next_out = s->o_buf;
-	s->z_stream.avail_out = s->ra_clen;
+/*
+ * Stream the chunk through inflate(), after resetting the stream.  All
+ * of the input is consumed, the flush marker may follow the last byte
+ * of output.
+ */
+static int
+zs_chunk(struct dc_decoder *d, const u_char *in, size_t inlen, char *out,
+    size_t outlen, size_t *len)
+{
+	z_stream *z = &d->d_stream;
+	int error;
 
-	while (error == Z_OK && !s->z_eof && s->z_stream.avail_out != 0) {
+	if (inflateReset(z) != Z_OK)
+		return -1;
 
-		if (s->z_stream.avail_in == 0)
-			break;
+	z->next_in = (u_char *)in;
+	z->avail_in = inlen;
+	z->next_out = (u_char *)out;
+	z->avail_out = outlen;
 
-		error = inflate(&(s->z_stream), Z_PARTIAL_FLUSH);
+	while (z->avail_in != 0) {
+		error = inflate(z, Z_PARTIAL_FLUSH);
 
 		if (error == Z_DATA_ERROR) {
 			errno = EINVAL;
-			goto bad;
+			return -1;
+		} else if (error == Z_BUF_ERROR && z->avail_out == 0) {
+			/* the chunk inflates to more than outlen */
+			errno = EFTYPE;
+			return -1;
 		} else if (error == Z_BUF_ERROR) {
 			errno = EIO;
-			goto bad;
-		} else if (error == Z_STREAM_END) {
-			s->z_eof = 1;
-			inflateReset(&(s->z_stream)); // XXX
+			return -1;
+		} else if (error == Z_STREAM_END)
+			break;
+	}
+
+	*len = outlen - z->avail_out;
+	if (*len != outlen) {
+		/* the chunk came up short */
+		errno = EFTYPE;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+zs_end(struct dc_decoder *d)
+{
+	inflateEnd(&d->d_stream);
+}
+
+struct zb_out {
+	char		*o_buf;
+	size_t		 o_len;
+	size_t		 o_avail;
+	int		 o_over;	/* more output than fits */
+};
+
+static int
+zb_init(struct dc_decoder *d)
+{
+	if ((d->d_window = malloc(1 << MAX_WBITS)) == NULL)
+		return -1;
+	if (inflateBackInit(&d->d_stream, MAX_WBITS, d->d_window) != Z_OK) {
+		free(d->d_window);
+		return -1;
+	}
+	return 0;
+}
+
+/* all input is given up front */
+static unsigned
+zb_in(void *arg, z_const u_char **buf)
+{
+	*buf = Z_NULL;
+	return 0;
+}
+
+static int
+zb_put(void *arg, u_char *buf, unsigned len)
+{
+	struct zb_out *o = arg;
+
+	if (len > o->o_avail) {
+		o->o_over = 1;
+		return -1;
+	}
+	memcpy(o->o_buf + o->o_len, buf, len);
+	o->o_len += len;
+	o->o_avail -= len;
+	return 0;
+}
+
+/*
+ * Inflate the chunk in one call of inflateBack(), which decodes from
+ * memory without the bookkeeping inflate() does to be resumable.  The
+ * chunk has no final block, so running out of input is the normal end.
+ */
+static int
+zb_chunk(struct dc_decoder *d, const u_char *in, size_t inlen, char *out,
+    size_t outlen, size_t *len)
+{
+	z_stream *z = &d->d_stream;
+	struct zb_out o;
+	int error;
+
+	o.o_buf = out;
+	o.o_len = 0;
+	o.o_avail = outlen;
+	o.o_over = 0;
+	z->next_in = (u_char *)in;
+	z->avail_in = inlen;
+
+	error = inflateBack(z, zb_in, NULL, zb_put, &o);
+	if (error == Z_DATA_ERROR) {
+		errno = EINVAL;
+		return -1;
+	} else if (o.o_over) {
+		/* the chunk inflates to more than outlen */
+		errno = EFTYPE;
+		return -1;
+	} else if (error != Z_STREAM_END && error != Z_BUF_ERROR) {
+		errno = EIO;
+		return -1;
+	} else if (o.o_len != outlen) {
+		/* the chunk came up short */
+		errno = EFTYPE;
+		return -1;
+	}
+
+	*len = o.o_len;
+	return 0;
+}
+
+static void
+zb_end(struct dc_decoder *d)
+{
+	inflateBackEnd(&d->d_stream);
+	free(d->d_window);
+}
+
+/*
+ * Return the inflated chunk, either from the LRU cache or by recycling
+ * the least recently used buffer.
+ */
+static struct gz_chunk *
+gz_chunk_get(gz_stream *s, struct dc_decoder *d, size_t chunk)
+{
+	struct gz_chunk *c;
+
+	TAILQ_FOREACH(c, &d->d_lru, c_entry)
+		if (c->c_chunk == chunk)
 			break;
+
+	if (c != NULL) {
+		d->d_hits++;
+		if (c != TAILQ_FIRST(&d->d_lru)) {
+			TAILQ_REMOVE(&d->d_lru, c, c_entry);
+			TAILQ_INSERT_HEAD(&d->d_lru, c, c_entry);
+		}
+		return c;
+	}
+
+	if (d->d_count < MAXIMUM(d->d_max, 1)) {
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			return NULL;
+		if ((c->c_buf = malloc(s->ra_clen)) == NULL) {
+			free(c);
+			return NULL;
+		}
+		d->d_count++;
+	} else {
+		TAILQ_FOREACH_REVERSE(c, &d->d_lru, gz_chunk_list, c_entry)
+			if (c->c_refs == 0)
+				break;
+		if (c == NULL) {
+			errno = EBUSY;
+			return NULL;
+		}
+		TAILQ_REMOVE(&d->d_lru, c, c_entry);
+	}
+	d->d_misses++;
+
+	if (gz_inflate(s, d, chunk, c) == -1) {
+		c->c_chunk = SIZE_MAX;
+		c->c_len = 0;
+		TAILQ_INSERT_TAIL(&d->d_lru, c, c_entry);
+		return NULL;
+	}
+	TAILQ_INSERT_HEAD(&d->d_lru, c, c_entry);
+
+	return c;
+}
+
+/*
+ * Call fn on the pieces of [off, off + len) in order.
+ */
+static int
+gz_pieces(gz_stream *s, struct dc_decoder *d, size_t off, size_t len,
+    dc_text_fn fn, void *arg)
+{
+	struct gz_chunk *c;
+	size_t chunk, n;
+
+	if (s->z_text != NULL) {
+		if (off > s->z_textlen || len > s->z_textlen - off)
+			return -1;
+		return fn(arg, s->z_text + off, len);
+	}
+
+	chunk = off / s->ra_clen;
+	off = off % s->ra_clen;
+	for (; len > 0; len -= n, chunk++, off = 0) {
+		if (chunk >= s->ra_ccount)
+			return -1;
+		if ((c = gz_chunk_get(s, d, chunk)) == NULL)
+			return -1;
+		if (off >= c->c_len)
+			return -1;
+		n = MINIMUM(len, c->c_len - off);
+		if (fn(arg, c->c_buf + off, n) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+gz_copy(void *arg, const char *buf, size_t len)
+{
+	char **out = arg;
+
+	memcpy(*out, buf, len);
+	*out += len;
+	return 0;
+}
+
+static int
+gz_read(gz_stream *s, struct dc_decoder *d, size_t off, char *out, size_t len)
+{
+	return gz_pieces(s, d, off, len, gz_copy, &out);
+}
+
+/*
+ * Give every worker of the pool a decoder of its own.
+ */
+static int
+gz_pool_decoders(gz_stream *s, struct dc_pool *pool)
+{
+	struct dc_decoder **dp;
+	u_int i, nworkers = pool_size(pool);
+
+	if (s->npool_dec >= nworkers)
+		return 0;
+	if ((dp = reallocarray(s->pool_dec, nworkers, sizeof(*dp))) == NULL)
+		return -1;
+	s->pool_dec = dp;
+	for (i = s->npool_dec; i < nworkers; i++) {
+		if ((dp[i] = decoder_open(s)) == NULL)
+			return -1;
+		s->npool_dec++;
+	}
+	return 0;
+}
+
+static void
+gz_inflate_work(void *arg, size_t start, size_t end, u_int worker)
+{
+	struct inflate_job *job = arg;
+	struct gz_chunk *c;
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		c = job->chunks[i];
+		if (gz_inflate(job->s, job->s->pool_dec[worker], c->c_chunk,
+		    c) == -1) {
+			c->c_chunk = SIZE_MAX;
+			c->c_len = 0;
 		}
 	}
+}
+
+/*
+ * Inflate the n chunks named by their c_chunk concurrently.  A chunk
+ * that fails is left with c_chunk SIZE_MAX.
+ */
+static int
+gz_inflate_pool(gz_stream *s, struct dc_pool *pool, struct gz_chunk **chunks,
+    size_t n)
+{
+	struct inflate_job job;
+
+	if (gz_pool_decoders(s, pool) == -1)
+		return -1;
+	job.s = s;
+	job.chunks = chunks;
+	pool_run(pool, gz_inflate_work, &job, n);
+	return 0;
+}
+
+static struct gz_chunk *
+gz_cached(struct dc_decoder *d, size_t chunk)
+{
+	struct gz_chunk *c;
+
+	TAILQ_FOREACH(c, &d->d_lru, c_entry)
+		if (c->c_chunk == chunk)
+			return c;
+	return NULL;
+}
 
-	cpylen = MINIMUM(len, s->ra_clen - off);
-	memcpy(out, s->o_buf + off, cpylen);
-	len -= cpylen;
-	out += cpylen;
-	chunk++;
-	off = 0;
-	if (len > 0)
-		goto again;
+/*
+ * Fill the cache of the database decoder with the chunks of the
+ * definitions from e on, starting at chunk, inflating the missing ones
+ * on the pool.  Chunks already cached are kept.  Nothing may be pinned.
+ */
+static int
+gz_prefetch(gz_stream *s, struct dc_pool *pool, struct dc_index_entry *e,
+    size_t chunk)
+{
+	struct dc_decoder *d = s->dec;
+	struct gz_chunk *c, *want[SCHED_WINDOW];
+	size_t seen[SCHED_WINDOW];
+	size_t n = 0, nseen = 0, i, last, max;
+
+	max = MINIMUM(MAXIMUM(d->d_max, 1), SCHED_WINDOW);
+	for (; e != NULL && nseen < max; e = SLIST_NEXT(e, entries)) {
+		if (e->def_len == 0 ||
+		    e->def_len - 1 > SIZE_MAX - e->def_off) {
+			chunk = SIZE_MAX;
+			continue;
+		}
+		if (chunk == SIZE_MAX)
+			chunk = e->def_off / s->ra_clen;
+		last = MINIMUM((e->def_off + e->def_len - 1) / s->ra_clen,
+		    (size_t)s->ra_ccount - 1);
+		for (; chunk <= last && nseen < max; chunk++) {
+			for (i = 0; i < nseen; i++)
+				if (seen[i] == chunk)
+					break;
+			if (i < nseen)
+				continue;
+			seen[nseen++] = chunk;
+
+			/* keep it from being recycled below */
+			if ((c = gz_cached(d, chunk)) != NULL) {
+				TAILQ_REMOVE(&d->d_lru, c, c_entry);
+				TAILQ_INSERT_HEAD(&d->d_lru, c, c_entry);
+				continue;
+			}
+
+			if (d->d_count < max) {
+				if ((c = calloc(1, sizeof(*c))) == NULL)
+					goto fail;
+				if ((c->c_buf = malloc(s->ra_clen)) == NULL) {
+					free(c);
+					goto fail;
+				}
+				d->d_count++;
+			} else {
+				c = TAILQ_LAST(&d->d_lru, gz_chunk_list);
+				TAILQ_REMOVE(&d->d_lru, c, c_entry);
+			}
+			c->c_chunk = chunk;
+			want[n++] = c;
+		}
+		chunk = SIZE_MAX;
+	}
 
+	if (gz_inflate_pool(s, pool, want, n) == -1)
+		goto fail;
+	d->d_misses += n;
+	for (i = 0; i < n; i++) {
+		/* failures are left for gz_chunk_get() to report */
+		if (want[i]->c_chunk == SIZE_MAX)
+			TAILQ_INSERT_TAIL(&d->d_lru, want[i], c_entry);
+		else
+			TAILQ_INSERT_HEAD(&d->d_lru, want[i], c_entry);
+	}
 	return 0;
- bad:
+ fail:
+	for (i = 0; i < n; i++) {
+		want[i]->c_chunk = SIZE_MAX;
+		want[i]->c_len = 0;
+		TAILQ_INSERT_TAIL(&d->d_lru, want[i], c_entry);
+	}
 	return -1;
 }
 
+/*
+ * Write out the pending iovecs and unpin their chunks.
+ */
+static int
+gz_flush(struct gz_writer *w)
+{
+	struct iovec *iov = w->w_iov;
+	ssize_t r;
+	int i, n = w->w_n, error = 0;
+
+	while (n > 0) {
+		if ((r = writev(w->w_fd, iov, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			error = -1;
+			break;
+		}
+		for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--)
+			r -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	for (i = 0; i < w->w_n; i++)
+		if (w->w_pin[i] != NULL)
+			w->w_pin[i]->c_refs--;
+	w->w_n = 0;
+
+	return error;
+}
+
+/*
+ * Queue len bytes at buf, pinning the chunk c they live in if any.
+ */
+static int
+gz_add(struct gz_writer *w, const void *buf, size_t len, struct gz_chunk *c)
+{
+	if (len == 0)
+		return 0;
+	if (w->w_n == WRITE_IOV && gz_flush(w) == -1)
+		return -1;
+
+	w->w_iov[w->w_n].iov_base = (void *)buf;
+	w->w_iov[w->w_n].iov_len = len;
+	w->w_pin[w->w_n] = c;
+	if (c != NULL)
+		c->c_refs++;
+	w->w_n++;
+
+	return 0;
+}
+
 static int
 gz_close(void *cookie)
 {
 	gz_stream *s = (gz_stream*)cookie;
-	int err = 0;
+	u_int i;
+	int err;
 
 	if (s == NULL)
 		return -1;
 
-	if (!err && s->z_stream.state != NULL) {
-		err = inflateEnd(&s->z_stream);
-	}
+	database_decoder_free(s->dec);
+	for (i = 0; i < s->npool_dec; i++)
+		database_decoder_free(s->pool_dec[i]);
+	free(s->pool_dec);
 
-	if (!err)
-		err = munmap(s->z_buf, s->z_buflen);
-	else
-		(void)munmap(s->z_buf, s->z_buflen);
+	err = munmap(s->z_buf, s->z_buflen);
+	if (s->z_map != NULL && munmap(s->z_map, s->z_maplen) == -1)
+		err = -1;
 
 	free(s->ra_chunks);
 	free(s->ra_offset);
-	free(s->o_buf);
 	free(s);
 
 	return err;
@@ -14,5 +14,28 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+struct dc_decoder;
+struct dc_pool;
+
+typedef int (*dc_text_fn)(void *, const char *, size_t);
+
+int database_codec(const char *);
 int database_open(char *, struct dc_database *);
-int database_lookup(struct dc_index_entry *, struct dc_database *, char *);
+int database_close(struct dc_database *);
+ssize_t database_lookup(struct dc_index_entry *, struct dc_database *, char *);
+ssize_t database_lookup_r(struct dc_index_entry *, struct dc_database *,
+    struct dc_decoder *, char *);
+int database_read(struct dc_index_entry *, struct dc_database *,
+    dc_text_fn, void *);
+int database_write(int, struct dc_database *, struct dc_index_list *,
+    const char *, struct dc_pool *);
+int database_lookup_pool(struct dc_database *, struct dc_pool *,
+    struct dc_lookup **, size_t);
+const void *database_header(struct dc_database *, size_t *);
+const char *database_text(struct dc_database *, struct dc_pool *, size_t *);
+int database_text_map(struct dc_database *, void *, size_t, size_t, size_t);
+int database_compressed(struct dc_database *);
+struct dc_decoder *database_decoder(struct dc_database *);
+void database_decoder_free(struct dc_decoder *);
+void database_cache(struct dc_database *, size_t);
+void database_stats(struct dc_database *, u_int64_t *, u_int64_t *);
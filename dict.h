@@ -17,7 +17,7 @@
 #include <sys/queue.h>
 
 #define WORD_MAX	4095
-#define LOOKUP_MAX	4095
+#define LEV_MAX		8	/* largest edit distance searched */
 
 #define MAXIMUM(a,b)	(((a)>(b))?(a):(b))
 #define MINIMUM(a,b)	(((a)<(b))?(a):(b))
@@ -31,13 +31,53 @@ struct dc_index_entry {
 	SLIST_ENTRY(dc_index_entry)	 entries;
 };
 
+struct dc_lookup {
+	struct dc_index_entry		*req;
+	char				*out;	/* def_len bytes */
+	ssize_t				 len;	/* or -1 */
+};
+
+/* what the file looked like when it was opened */
+struct dc_ident {
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	struct timespec	 mtime;
+};
+
+struct dc_index_rec;
+struct dc_index_sa;
+struct dc_index_ph;
+struct dc_index_trie;
+
 struct dc_index {
 	const char 	*data;
 	off_t		 size;
+	struct dc_ident	 ident;
+	const struct dc_index_rec *recs;	/* from the .bin sidecar */
+	size_t		 nrecs;
+	const struct dc_index_sa *sa;		/* from the .sa sidecar */
+	size_t		 nsa;
+	const struct dc_index_ph *ph;		/* from the .ph sidecar */
+	size_t		 nph;
+	const struct dc_index_trie *trie;	/* from the .trie sidecar */
+	size_t		 ntrie;			/* in bytes */
+	const u_int64_t	*eyt;			/* from the .eyt sidecar */
+	size_t		 neyt;
+};
+
+/* the matches of one request, see index_cursor_next() */
+struct dc_cursor {
+	const struct dc_index	*c_idx;
+	off_t			 c_pos;		/* next match */
+	off_t			 c_end;		/* past the last match */
 };
 
 struct dc_database {
+	const char			*name;
+	char				*path;		/* opened from */
 	void				*data;
 	off_t		 		 size;
+	struct dc_ident			 ident;
 	struct dc_index			 index;
 };
@@ -19,235 +19,2338 @@
 #include <sys/queue.h>
 
 #include <assert.h>
-#include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "dict.h"
 #include "index.h"
+#include "pool.h"
+#include "validate.h"
+
+#define VALIDATE_SLICES		4		/* per worker */
+#define VALIDATE_SLICE_MIN	(1024 * 1024)
+
+#define INDEX_PARSE_BATCH	64		/* entries parsed at once */
+#define INDEX_LINE_MIN		5		/* "\tA\tA\n" */
+
+#define LEV_SLICES		4		/* per worker */
+#define LEV_SLICE_RECS		16384		/* sidecar records */
+#define LEV_SLICE_MIN		(256 * 1024)	/* text index bytes */
+
+#define INDEX_BIN_MAGIC		"DCIXBIN"
+#define INDEX_SA_MAGIC		"DCIXSUF"
+#define INDEX_PH_MAGIC		"DCIXPHT"
+#define INDEX_TRIE_MAGIC	"DCIXTRI"
+#define INDEX_EYT_MAGIC		"DCIXEYT"
+#define INDEX_BIN_VERSION	1
+
+/*
+ * The .index.bin sidecar is a header followed by one fixed-size record
+ * per line of the text index, in the same order.  Headwords are not
+ * copied, records point into the text index.
+ *
+ * The .index.sa sidecar has the same header followed by the suffix
+ * array of the headwords: one record per suffix, sorted by the suffix.
+ *
+ * The .index.ph sidecar is a hash table of the distinct headwords, with
+ * linear probing, a power of two slots and at most half of them used.
+ *
+ * The .index.trie sidecar is a compressed trie of the headwords, one
+ * byte records.  struct dc_index_trie follows the header, then the
+ * nodes, each written after its children:
+ *
+ *	node:	nedges << 2 | min(nvals, 3) [nvals - 3] { def_off def_len }*
+ *		edge*
+ *	edge:	len label count dist
+ *
+ * Numbers are LEB128 varints.  Edges are sorted by label, count is the
+ * number of entries below the edge and dist how far the child lies
+ * before the node.  Node offsets start after struct dc_index_trie.
+ *
+ * The .index.eyt sidecar holds the records of the .bin sidecar in
+ * Eytzinger order, the implicit binary tree with the children of node k
+ * at 2k and 2k + 1.  After a few words of padding, so the array starts
+ * on a cache line, come the keys, the first eight bytes of each
+ * headword as a big-endian number, then the record numbers.
+ */
+struct dc_index_hdr {
+	char		h_magic[8];
+	u_int32_t	h_version;
+	u_int32_t	h_recsize;
+	u_int64_t	h_size;		/* size of the text index */
+	int64_t		h_mtime;	/* and its modification time */
+	u_int64_t	h_count;	/* number of records */
+};
+
+struct dc_index_rec {
+	u_int64_t	r_word;		/* headword offset in the text index */
+	u_int64_t	r_def_off;
+	u_int64_t	r_def_len;
+	u_int32_t	r_word_len;
+	u_int32_t	r_pad;
+};
+
+struct dc_index_sa {
+	u_int64_t	s_suffix;	/* suffix offset in the text index */
+	u_int64_t	s_line;		/* start of its line */
+};
+
+struct dc_index_ph {
+	u_int64_t	p_hash;
+	u_int64_t	p_line;		/* first line of the headword */
+	u_int64_t	p_end;		/* past its last line */
+	u_int32_t	p_rec;		/* first record in the .bin sidecar */
+	u_int32_t	p_count;	/* lines, 0 if the slot is free */
+};
+
+#define INDEX_EYT_PAD	((64 - sizeof(struct dc_index_hdr)) / sizeof(u_int64_t))
+
+struct dc_index_trie {
+	u_int64_t	t_root;		/* offset of the root node */
+	u_int64_t	t_count;	/* entries */
+	u_int64_t	t_maxlen;	/* longest headword */
+};
+
+/* a trie under construction */
+struct trie_buf {
+	u_char		*b_data;
+	size_t		 b_len;
+	size_t		 b_size;
+};
+
+struct trie_key {
+	const char	*k_word;
+	size_t		 k_len;
+	size_t		 k_off;
+	size_t		 k_dlen;
+};
+
+struct trie_edge {
+	size_t		 e_lo, e_hi;	/* keys below the edge */
+	size_t		 e_end;		/* depth at the end of the label */
+	size_t		 e_node;
+};
+
+/* see index_complete() */
+struct complete_range {
+	off_t		 r_first;
+	off_t		 r_last;
+};
+
+struct dc_complete {
+	const struct dc_index	*cp_idx;
+	char			*cp_word;	/* the current prefix */
+	size_t			 cp_len;
+	struct complete_range	*cp_ranges;	/* per prefix length */
+	size_t			 cp_size;
+};
+
+/* an enumeration of the trie */
+struct trie_walk {
+	const u_char		*w_nodes;
+	size_t			 w_len;
+	char			*w_key;		/* the current headword */
+	size_t			 w_keylen;
+	size_t			 w_maxlen;
+	size_t			 w_offset;	/* entries still to skip */
+	size_t			 w_limit;
+	size_t			 w_n;
+	struct dc_arena		*w_arena;
+	struct dc_index_list	*w_list;
+	struct dc_index_entry	*w_last;
+};
+
+static off_t index_line_next(const struct dc_index *, off_t);
+static const char *index_parse_line(const char *, const char *,
+    struct dc_index_entry *, size_t *);
+
+/*
+ * The sidecar records, to be covered by the validation cache.
+ */
+const void *
+index_records(const struct dc_index *idx, size_t *len)
+{
+	*len = idx->nrecs * sizeof(struct dc_index_rec);
+	return idx->recs;
+}
+
+/*
+ * The suffix array, to be covered by the validation cache.
+ */
+const void *
+index_suffixes(const struct dc_index *idx, size_t *len)
+{
+	*len = idx->nsa * sizeof(struct dc_index_sa);
+	return idx->sa;
+}
+
+/*
+ * The hash table, to be covered by the validation cache.
+ */
+const void *
+index_hashes(const struct dc_index *idx, size_t *len)
+{
+	*len = idx->nph * sizeof(struct dc_index_ph);
+	return idx->ph;
+}
+
+/*
+ * The trie, to be covered by the validation cache.
+ */
+const void *
+index_trie(const struct dc_index *idx, size_t *len)
+{
+	*len = idx->ntrie;
+	return idx->trie;
+}
+
+/*
+ * The search layout, to be covered by the validation cache.
+ */
+const void *
+index_layout(const struct dc_index *idx, size_t *len)
+{
+	*len = idx->neyt * 2 * sizeof(u_int64_t);
+	return idx->eyt;
+}
+
+/*
+ * The first eight bytes of a word up to end, as a big-endian number
+ * padded with zeros.  Compares like the words as far as it goes.
+ */
+static u_int64_t
+index_key8(const char *w, char end)
+{
+	u_int64_t k = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		k <<= 8;
+		if (*w != end)
+			k |= (u_char)*w++;
+	}
+	return k;
+}
+
+/*
+ * FNV-1a with a final mix, the table uses the low bits.
+ */
+static u_int64_t
+index_hash(const char *w, size_t len)
+{
+	u_int64_t h = 0xcbf29ce484222325ULL;
+
+	while (len-- > 0) {
+		h ^= (u_char)*w++;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Use a sidecar only if it was built from this very text index,
+ * otherwise silently fall back to searching the text.  Returns the
+ * records of path.suffix and their number in *count.
+ */
+static const void *
+index_open_sidecar(const char *path, const char *suffix, const char *magic,
+    size_t recsize, const struct stat *isb, size_t *count)
+{
+	const struct dc_index_hdr *h;
+	const void *recs = NULL;
+	struct stat sb;
+	char *bpath;
+	void *p;
+	int fd;
+
+	*count = 0;
+	if (asprintf(&bpath, "%s%s", path, suffix) == -1)
+		return NULL;
+	fd = open(bpath, O_RDONLY);
+	free(bpath);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*h))
+		goto done;
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		goto done;
+
+	h = p;
+	if (memcmp(h->h_magic, magic, sizeof(h->h_magic)) != 0 ||
+	    h->h_version != INDEX_BIN_VERSION ||
+	    h->h_recsize != recsize ||
+	    h->h_size != (u_int64_t)isb->st_size ||
+	    h->h_mtime != isb->st_mtime ||
+	    (sb.st_size - sizeof(*h)) % recsize != 0 ||
+	    h->h_count != (sb.st_size - sizeof(*h)) / recsize) {
+		munmap(p, sb.st_size);
+		goto done;
+	}
+	recs = h + 1;
+	*count = h->h_count;
+ done:
+	close(fd);
+	return recs;
+}
 
 int
 index_open(char *path, struct dc_index *idx)
 {
 	struct stat sb;
+	size_t n;
 	int fd;
 
+	idx->recs = NULL;
+	idx->nrecs = 0;
+	idx->sa = NULL;
+	idx->nsa = 0;
+	idx->ph = NULL;
+	idx->nph = 0;
+	idx->trie = NULL;
+	idx->ntrie = 0;
+	idx->eyt = NULL;
+	idx->neyt = 0;
+
 	if ((fd = open(path, O_RDONLY)) == -1)
 		return -1;
 	if (fstat(fd, &sb) == -1)
 		return -1;
 	idx->size = sb.st_size;
+	idx->ident.dev = sb.st_dev;
+	idx->ident.ino = sb.st_ino;
+	idx->ident.size = sb.st_size;
+	idx->ident.mtime = sb.st_mtim;
 
 	idx->data = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (idx->data == MAP_FAILED)
 		return -1;
 
+	idx->recs = index_open_sidecar(path, ".bin", INDEX_BIN_MAGIC,
+	    sizeof(struct dc_index_rec), &sb, &idx->nrecs);
+	idx->sa = index_open_sidecar(path, ".sa", INDEX_SA_MAGIC,
+	    sizeof(struct dc_index_sa), &sb, &idx->nsa);
+	idx->ph = index_open_sidecar(path, ".ph", INDEX_PH_MAGIC,
+	    sizeof(struct dc_index_ph), &sb, &idx->nph);
+	idx->trie = index_open_sidecar(path, ".trie", INDEX_TRIE_MAGIC, 1,
+	    &sb, &idx->ntrie);
+	idx->eyt = index_open_sidecar(path, ".eyt", INDEX_EYT_MAGIC,
+	    sizeof(u_int64_t), &sb, &n);
+	if (idx->eyt != NULL && n >= INDEX_EYT_PAD &&
+	    (n - INDEX_EYT_PAD) % 2 == 0) {
+		idx->eyt += INDEX_EYT_PAD;
+		idx->neyt = (n - INDEX_EYT_PAD) / 2;
+	} else
+		idx->eyt = NULL;
+
 	return 0;
 }
 
-int
-index_validate(struct dc_index *idx, off_t db_size)
+/*
+ * Start writing path.suffix under a temporary name, the header is
+ * written again by index_commit() once the records are counted.
+ */
+static FILE *
+index_create(const char *path, const char *suffix, const char *magic,
+    size_t recsize, const struct stat *sb, struct dc_index_hdr *h,
+    char **tpath)
 {
-	off_t i;
-	int b64off_max = 0, b64len_max = 0, tabs = 0, b64chars = -1;
-	char c;
+	FILE *fp;
+	int fd;
 
-	for (; db_size; db_size >>= 6)
-		b64off_max++;
+	if (asprintf(tpath, "%s%s.XXXXXXXXXX", path, suffix) == -1) {
+		*tpath = NULL;
+		return NULL;
+	}
+	if ((fd = mkstemp(*tpath)) == -1)
+		goto fail;
+	if (fchmod(fd, sb->st_mode & 0444) == -1 ||
+	    (fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(*tpath);
+		goto fail;
+	}
 
-	for (i = LOOKUP_MAX; i; i >>= 6)
-		b64len_max++;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->h_magic, magic, sizeof(h->h_magic));
+	h->h_version = INDEX_BIN_VERSION;
+	h->h_recsize = recsize;
+	h->h_size = sb->st_size;
+	h->h_mtime = sb->st_mtime;
+	if (fwrite(h, sizeof(*h), 1, fp) != 1) {
+		fclose(fp);
+		unlink(*tpath);
+		goto fail;
+	}
+	return fp;
 
-	for(i = 0; i < idx->size; i++) {
-		c = idx->data[i];
-		if (c == '\t') {
-			if (tabs == 1 && b64chars > b64off_max)
-				return -1;
-			else if (tabs == 2 && b64chars > b64len_max)
-				return -1;
-			else if (b64chars == 0)
-				return -1;
-			tabs++;
-			b64chars = 0;
-			if (tabs > 2)
-				return -1;
-		} else if (c == '\n') {
-			if (tabs != 2)
-				return -1;
-			tabs = 0;
-		} else if (tabs) {
-			if ((c != '+' && c < '/') || (c > '9' && c < 'A')
-			    || (c > 'Z' && c < 'a') || (c > 'z')) {
-				return -1;
+ fail:
+	free(*tpath);
+	*tpath = NULL;
+	return NULL;
+}
+
+/*
+ * Finish the sidecar and move it in place, or remove it if ok is 0.
+ */
+static int
+index_commit(FILE *fp, char *tpath, const char *path, const char *suffix,
+    const struct dc_index_hdr *h, int ok)
+{
+	char *bpath = NULL;
+	int ret = -1;
+
+	if (ok && (fseeko(fp, 0, SEEK_SET) == -1 ||
+	    fwrite(h, sizeof(*h), 1, fp) != 1))
+		ok = 0;
+	if (fclose(fp) == EOF)
+		ok = 0;
+	if (ok && asprintf(&bpath, "%s%s", path, suffix) != -1 &&
+	    rename(tpath, bpath) == 0)
+		ret = 0;
+	if (ret == -1)
+		unlink(tpath);
+	free(bpath);
+	free(tpath);
+	return ret;
+}
+
+static int
+index_build_bin(const char *path, const struct dc_index *idx,
+    const struct stat *sb)
+{
+	struct dc_index_hdr h;
+	struct dc_index_rec r;
+	struct dc_index_entry e;
+	const char *p = idx->data, *end = idx->data + idx->size;
+	char *tpath;
+	FILE *fp;
+	size_t l;
+
+	if ((fp = index_create(path, ".bin", INDEX_BIN_MAGIC, sizeof(r), sb,
+	    &h, &tpath)) == NULL)
+		return -1;
+
+	while (p < end) {
+		memset(&r, 0, sizeof(r));
+		r.r_word = p - idx->data;
+		if ((p = index_parse_line(p, end, &e, &l)) == NULL)
+			return index_commit(fp, tpath, path, ".bin", &h, 0);
+		r.r_word_len = l;
+		r.r_def_off = e.def_off;
+		r.r_def_len = e.def_len;
+		if (fwrite(&r, sizeof(r), 1, fp) != 1)
+			return index_commit(fp, tpath, path, ".bin", &h, 0);
+		h.h_count++;
+	}
+
+	return index_commit(fp, tpath, path, ".bin", &h, 1);
+}
+
+static const char *index_sa_data;	/* for index_sa_cmp() */
+
+/*
+ * Order suffixes like index_exact_cmp() orders headwords, ties by
+ * position.
+ */
+static int
+index_sa_cmp(const void *a, const void *b)
+{
+	const struct dc_index_sa *sa = a, *sb = b;
+	const u_char *p = (const u_char *)index_sa_data + sa->s_suffix;
+	const u_char *q = (const u_char *)index_sa_data + sb->s_suffix;
+
+	for (; *p == *q && *p != '\t'; p++, q++)
+		;
+	if (*p != *q) {
+		if (*p == '\t')
+			return -1;
+		if (*q == '\t')
+			return 1;
+		return *p < *q ? -1 : 1;
+	}
+	return (sa->s_suffix > sb->s_suffix) - (sa->s_suffix < sb->s_suffix);
+}
+
+static int
+index_build_sa(const char *path, const struct dc_index *idx,
+    const struct stat *sb)
+{
+	struct dc_index_hdr h;
+	struct dc_index_sa *sa = NULL, *n;
+	const char *p = idx->data, *end = idx->data + idx->size;
+	char *tpath;
+	FILE *fp;
+	size_t nsa = 0, max = 0, l, i;
+	int ok = 0;
+
+	if ((fp = index_create(path, ".sa", INDEX_SA_MAGIC, sizeof(*sa), sb,
+	    &h, &tpath)) == NULL)
+		return -1;
+
+	while (p < end) {
+		for (l = 0; p[l] != '\t'; l++)
+			;
+		for (i = 0; i < l; i++) {
+			if (nsa == max) {
+				max = MAXIMUM(1024, max * 2);
+				if ((n = reallocarray(sa, max,
+				    sizeof(*sa))) == NULL)
+					goto done;
+				sa = n;
 			}
-			b64chars++;
+			sa[nsa].s_suffix = p + i - idx->data;
+			sa[nsa].s_line = p - idx->data;
+			nsa++;
 		}
+		p = (const char *)memchr(p + l, '\n', end - p - l) + 1;
 	}
-	if (idx->data[idx->size - 1] != '\n')
-		return -1;
-	return 0;
+
+	index_sa_data = idx->data;
+	qsort(sa, nsa, sizeof(*sa), index_sa_cmp);
+	if (nsa > 0 && fwrite(sa, sizeof(*sa), nsa, fp) != nsa)
+		goto done;
+	h.h_count = nsa;
+	ok = 1;
+ done:
+	free(sa);
+	return index_commit(fp, tpath, path, ".sa", &h, ok);
 }
 
-static size_t
-index_parse_b64(const char *data, size_t *res)
+static int
+index_build_ph(const char *path, const struct dc_index *idx,
+    const struct stat *sb)
 {
-	char c;
-	int i, l = 0;
-	*res = 0;
+	struct dc_index_hdr h;
+	struct dc_index_ph *ph = NULL, *p;
+	const char *w, *pw = NULL;
+	char *tpath;
+	FILE *fp;
+	size_t nwords = 0, size = 2, l, pl = 0, i;
+	off_t pos;
+	u_int32_t rec;
+	int ok = 0;
 
-	while (data[l + 1] != '\t' && data[l + 1] != '\n') l++;
+	if ((fp = index_create(path, ".ph", INDEX_PH_MAGIC, sizeof(*ph), sb,
+	    &h, &tpath)) == NULL)
+		return -1;
 
-	for (i = 0; i < l; i++) {
-		c = data[l - i];
-		if (c == '+') {
-			c = 62;
-		} else if (c == '/') {
-			c = 63;
-		} else if (c >= '0' && c <= '9') {
-			c += 4;
-		} else if (c >= 'A' && c <= 'Z') {
-			c -= 65;
-		} else if (c >= 'a' && c <= 'z') {
-			c -= 71;
-		} else
-			errx(1, "not base 64");
+	/* equal headwords are neighbours in the sorted index */
+	for (pos = 0; pos < idx->size; pos = index_line_next(idx, pos)) {
+		w = idx->data + pos;
+		l = (const char *)memchr(w, '\t', idx->size - pos) - w;
+		if (pw == NULL || l != pl || memcmp(w, pw, l) != 0)
+			nwords++;
+		pw = w;
+		pl = l;
+	}
+	while (size < nwords * 2)
+		size *= 2;
+	if ((ph = calloc(size, sizeof(*ph))) == NULL)
+		goto done;
 
-		*res += c << (i * 6);
+	p = NULL;
+	for (pos = 0, rec = 0; pos < idx->size;
+	    pos = index_line_next(idx, pos), rec++) {
+		w = idx->data + pos;
+		l = (const char *)memchr(w, '\t', idx->size - pos) - w;
+		if (p != NULL && l == pl && memcmp(w, pw, l) == 0) {
+			p->p_count++;
+			p->p_end = index_line_next(idx, pos);
+			continue;
+		}
+		for (i = index_hash(w, l) & (size - 1); ph[i].p_count != 0;
+		    i = (i + 1) & (size - 1))
+			;
+		p = &ph[i];
+		p->p_hash = index_hash(w, l);
+		p->p_line = pos;
+		p->p_end = index_line_next(idx, pos);
+		p->p_rec = rec;
+		p->p_count = 1;
+		pw = w;
+		pl = l;
 	}
 
-	return l + 1;
+	if (fwrite(ph, sizeof(*ph), size, fp) != size)
+		goto done;
+	h.h_count = size;
+	ok = 1;
+ done:
+	free(ph);
+	return index_commit(fp, tpath, path, ".ph", &h, ok);
 }
 
-static struct dc_index_entry *
-index_parse_line(const char *line, struct dc_index_entry *e)
+static int
+trie_put(struct trie_buf *b, const void *p, size_t len)
 {
-	const char *data;
-	size_t l = 0;
+	u_char *n;
+	size_t size;
 
-	e->match = line;
+	if (b->b_size - b->b_len < len) {
+		size = MAXIMUM(4096, b->b_size);
+		while (size - b->b_len < len)
+			size *= 2;
+		if ((n = realloc(b->b_data, size)) == NULL)
+			return -1;
+		b->b_data = n;
+		b->b_size = size;
+	}
+	memcpy(b->b_data + b->b_len, p, len);
+	b->b_len += len;
+	return 0;
+}
 
-	while (line[l] != '\t') l++;
-	if (l > WORD_MAX)
-		l = WORD_MAX;
-	e->match_len = l;
+static int
+trie_put_uv(struct trie_buf *b, u_int64_t v)
+{
+	u_char buf[10];
+	size_t n = 0;
 
-	data = line + l;
-	data += index_parse_b64(data, &e->def_off);
-	index_parse_b64(data, &e->def_len);
+	do {
+		buf[n] = v & 0x7f;
+		if ((v >>= 7) != 0)
+			buf[n] |= 0x80;
+		n++;
+	} while (v != 0);
+	return trie_put(b, buf, n);
+}
 
-	if (e->def_len > LOOKUP_MAX)
-		e->def_len =  LOOKUP_MAX;
+static int
+trie_key_cmp(const void *a, const void *b)
+{
+	const struct trie_key *ka = a, *kb = b;
+	int r;
 
-	return e;
+	r = memcmp(ka->k_word, kb->k_word, MINIMUM(ka->k_len, kb->k_len));
+	if (r != 0)
+		return r;
+	if (ka->k_len != kb->k_len)
+		return ka->k_len < kb->k_len ? -1 : 1;
+	return ka->k_word < kb->k_word ? -1 : ka->k_word > kb->k_word;
 }
 
 /*
- * key is NUL terminated
- * entry is HT terminated
+ * Write the node of keys[lo, hi), which share their first depth bytes,
+ * after the nodes of its children.  Its offset is returned in *node.
  */
 static int
-index_exact_cmp(const char *key, const char *entry)
+trie_build_node(struct trie_buf *b, const struct trie_key *keys, size_t lo,
+    size_t hi, size_t depth, size_t *node)
 {
-	size_t klen = strlen(key), elen = 0;
-	int r;
+	struct trie_edge *edges = NULL, *e;
+	const struct trie_key *f, *l;
+	size_t vals, nedges = 0, i, j, n;
+	int ret = -1;
 
-	while (entry[elen] != '\t') elen++;
-	r = strncmp(key, entry, MINIMUM(klen, elen));
+	/* shorter keys sort first */
+	for (vals = lo; vals < hi && keys[vals].k_len == depth; vals++)
+		;
+	for (i = vals; i < hi; i = j, nedges++)
+		for (j = i + 1; j < hi &&
+		    keys[j].k_word[depth] == keys[i].k_word[depth]; j++)
+			;
+	if (nedges > 0 && (edges = calloc(nedges, sizeof(*edges))) == NULL)
+		return -1;
 
-	if (r == 0 && klen < elen)
+	for (i = vals, e = edges; i < hi; i = j, e++) {
+		for (j = i + 1; j < hi &&
+		    keys[j].k_word[depth] == keys[i].k_word[depth]; j++)
+			;
+		f = &keys[i];
+		l = &keys[j - 1];
+		for (n = depth + 1; n < f->k_len && n < l->k_len &&
+		    f->k_word[n] == l->k_word[n]; n++)
+			;
+		e->e_lo = i;
+		e->e_hi = j;
+		e->e_end = n;
+		if (trie_build_node(b, keys, i, j, n, &e->e_node) == -1)
+			goto done;
+	}
+
+	*node = b->b_len;
+	n = vals - lo;
+	if (trie_put_uv(b, (u_int64_t)nedges << 2 | MINIMUM(n, 3)) == -1 ||
+	    (n >= 3 && trie_put_uv(b, n - 3) == -1))
+		goto done;
+	for (i = lo; i < vals; i++)
+		if (trie_put_uv(b, keys[i].k_off) == -1 ||
+		    trie_put_uv(b, keys[i].k_dlen) == -1)
+			goto done;
+	for (e = edges; e < edges + nedges; e++)
+		if (trie_put_uv(b, e->e_end - depth) == -1 ||
+		    trie_put(b, keys[e->e_lo].k_word + depth,
+		    e->e_end - depth) == -1 ||
+		    trie_put_uv(b, e->e_hi - e->e_lo) == -1 ||
+		    trie_put_uv(b, *node - e->e_node) == -1)
+			goto done;
+	ret = 0;
+ done:
+	free(edges);
+	return ret;
+}
+
+static int
+index_build_trie(const char *path, const struct dc_index *idx,
+    const struct stat *sb)
+{
+	struct dc_index_hdr h;
+	struct dc_index_trie t;
+	struct dc_index_entry e;
+	struct trie_buf b;
+	struct trie_key *keys = NULL, *n;
+	const char *p = idx->data, *end = idx->data + idx->size;
+	char *tpath;
+	FILE *fp;
+	size_t nkeys = 0, max = 0, l, root;
+	int ok = 0;
+
+	if ((fp = index_create(path, ".trie", INDEX_TRIE_MAGIC, 1, sb, &h,
+	    &tpath)) == NULL)
 		return -1;
-	else if (r == 0 && elen < klen)
-		return 1;
-	return r;
+	memset(&b, 0, sizeof(b));
+	memset(&t, 0, sizeof(t));
+
+	while (p < end) {
+		if (nkeys == max) {
+			max = MAXIMUM(1024, max * 2);
+			if ((n = reallocarray(keys, max, sizeof(*keys))) ==
+			    NULL)
+				goto done;
+			keys = n;
+		}
+		keys[nkeys].k_word = p;
+		if ((p = index_parse_line(p, end, &e, &l)) == NULL)
+			goto done;
+		keys[nkeys].k_len = l;
+		keys[nkeys].k_off = e.def_off;
+		keys[nkeys].k_dlen = e.def_len;
+		t.t_maxlen = MAXIMUM(t.t_maxlen, l);
+		nkeys++;
+	}
+
+	qsort(keys, nkeys, sizeof(*keys), trie_key_cmp);
+	if (trie_build_node(&b, keys, 0, nkeys, 0, &root) == -1)
+		goto done;
+	t.t_root = root;
+	t.t_count = nkeys;
+	if (fwrite(&t, sizeof(t), 1, fp) != 1 ||
+	    fwrite(b.b_data, 1, b.b_len, fp) != b.b_len)
+		goto done;
+	h.h_count = sizeof(t) + b.b_len;
+	ok = 1;
+ done:
+	free(b.b_data);
+	free(keys);
+	return index_commit(fp, tpath, path, ".trie", &h, ok);
 }
 
 /*
- * key is NUL terminated
- * entry is HT terminated
+ * Fill keys[k - 1] and recs[k - 1] for the subtree of node k in order,
+ * taking the sorted lines from line i on.  Returns the next line.
  */
+static size_t
+eyt_fill(const u_int64_t *lines, u_int64_t *keys, u_int64_t *recs,
+    size_t n, size_t i, size_t k)
+{
+	if (k > n)
+		return i;
+	i = eyt_fill(lines, keys, recs, n, i, 2 * k);
+	keys[k - 1] = lines[i];
+	recs[k - 1] = i;
+	return eyt_fill(lines, keys, recs, n, i + 1, 2 * k + 1);
+}
+
 static int
-index_prefix_cmp(const char *key, const char *entry)
+index_build_eyt(const char *path, const struct dc_index *idx,
+    const struct stat *sb)
 {
-	size_t klen = strlen(key), elen = 0;
-	int r;
+	struct dc_index_hdr h;
+	u_int64_t pad[INDEX_EYT_PAD], *lines = NULL, *keys = NULL, *n;
+	off_t pos;
+	char *tpath;
+	FILE *fp;
+	size_t nlines = 0, max = 0;
+	int ok = 0;
 
-	while (entry[elen] != '\t') elen++;
-	r = strncmp(key, entry, MINIMUM(klen, elen));
+	if ((fp = index_create(path, ".eyt", INDEX_EYT_MAGIC,
+	    sizeof(u_int64_t), sb, &h, &tpath)) == NULL)
+		return -1;
 
-	if (r == 0 && elen < klen)
-		return 1;
-	return r;
+	for (pos = 0; pos < idx->size; pos = index_line_next(idx, pos)) {
+		if (nlines == max) {
+			max = MAXIMUM(1024, max * 2);
+			if ((n = reallocarray(lines, max, sizeof(*lines))) ==
+			    NULL)
+				goto done;
+			lines = n;
+		}
+		lines[nlines++] = index_key8(idx->data + pos, '\t');
+	}
+	if ((keys = reallocarray(NULL, nlines, 2 * sizeof(*keys))) == NULL)
+		goto done;
+	eyt_fill(lines, keys, keys + nlines, nlines, 0, 1);
+
+	memset(pad, 0, sizeof(pad));
+	if (fwrite(pad, sizeof(pad), 1, fp) != 1 ||
+	    fwrite(keys, 2 * sizeof(*keys), nlines, fp) != nlines)
+		goto done;
+	h.h_count = INDEX_EYT_PAD + 2 * nlines;
+	ok = 1;
+ done:
+	free(lines);
+	free(keys);
+	return index_commit(fp, tpath, path, ".eyt", &h, ok);
 }
 
-static void *
-index_bsearch(const char *key, const struct dc_index *idx,
-    int (*compar)(const char *, const char *))
+/*
+ * Write the .index.bin, .index.sa, .index.ph, .index.trie and
+ * .index.eyt sidecars for a validated text index.
+ */
+int
+index_build(char *path, const struct dc_index *idx)
 {
-	const char *base = idx->data;
-	const char *end = idx->data + idx->size;
-	const char *p;
-	size_t lim;
-	int cmp;
+	struct stat sb;
 
-	for (lim = idx->size; lim != 0; lim >>= 1) {
-		p = base + (lim >> 1);
-		while (p < end && p[0] != '\n') p++;
-		p++;
-		cmp = (*compar)(key, p);
-		if (cmp == 0)
-			return ((void *)p);
-		if (cmp > 0) {  /* key > p: move right */
-			base = (char *)p;
-			lim--;
-		} /* else move left */
+	if (stat(path, &sb) == -1)
+		return -1;
+	if (index_build_bin(path, idx, &sb) == -1 ||
+	    index_build_sa(path, idx, &sb) == -1 ||
+	    index_build_ph(path, idx, &sb) == -1 ||
+	    index_build_trie(path, idx, &sb) == -1 ||
+	    index_build_eyt(path, idx, &sb) == -1)
+		return -1;
+	return 0;
+}
+
+struct lev_hit {
+	off_t			 h_pos;
+	u_int			 h_dist;
+};
+
+struct lev_slice {
+	off_t			 s_from;
+	off_t			 s_to;
+	struct lev_hit		*s_hits;
+	size_t			 s_nhits;
+	size_t			 s_max;
+	int			 s_error;
+};
+
+struct lev_job {
+	const struct dc_index	*idx;
+	const char		*key;
+	size_t			 klen;
+	u_int			 maxd;
+	struct lev_slice	*slices;
+};
+
+/*
+ * Read the varint at *pos, not past len.
+ */
+static int
+trie_get_uv(const u_char *p, size_t len, size_t *pos, u_int64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64 && *pos < len; shift += 7) {
+		*v |= (u_int64_t)(p[*pos] & 0x7f) << shift;
+		if ((p[(*pos)++] & 0x80) == 0)
+			return 0;
 	}
-	return (NULL);
+	return -1;
 }
 
+/*
+ * Read the counts at the start of a node.
+ */
 static int
-index_find(const char *req, const struct dc_index *idx,
-    struct dc_index_list *lst, int (*compar)(const char *, const char *))
+trie_get_node(const u_char *p, size_t len, size_t *pos, u_int64_t *nvals,
+    u_int64_t *nedges)
 {
+	u_int64_t v;
 
-	const char *base = idx->data;
-	const char *end = idx->data + idx->size;
-	struct dc_index_entry *e = SLIST_FIRST(lst);
-	const char *p;
-	int r = 0;
+	if (trie_get_uv(p, len, pos, &v) == -1)
+		return -1;
+	*nedges = v >> 2;
+	*nvals = v & 3;
+	if (*nvals == 3) {
+		if (trie_get_uv(p, len, pos, &v) == -1 || v > len)
+			return -1;
+		*nvals += v;
+	}
+	return 0;
+}
+
+/*
+ * The trie nodes and their size, NULL without the sidecar.
+ */
+static const u_char *
+index_trie_nodes(const struct dc_index *idx, size_t *len)
+{
+	if (idx->trie == NULL || idx->ntrie < sizeof(*idx->trie))
+		return NULL;
+	*len = idx->ntrie - sizeof(*idx->trie);
+	return (const u_char *)(idx->trie + 1);
+}
+
+/*
+ * Check the subtree of node, which must start at lo, hold count entries
+ * and whose keys are depth bytes long so far.  The end of the node is
+ * returned in *end, where the next sibling's subtree starts.  So every
+ * byte belongs to exactly one node and the walk is linear.
+ */
+static int
+trie_check(const u_char *p, size_t len, size_t node, size_t lo,
+    u_int64_t count, u_int64_t depth, u_int64_t maxlen, size_t *end)
+{
+	size_t pos = node;
+	u_int64_t nvals, nedges, i, v, lablen, cnt, dist, sum;
+	int prev = -1;
 
-	if ((p = index_bsearch(req, idx, compar)) == NULL)
+	if (node >= len || trie_get_node(p, len, &pos, &nvals, &nedges) == -1 ||
+	    nvals > count)
 		return -1;
-	do {
-		p--;
-		while (p > base && p[-1] != '\n') p--;
-	} while (compar(req, p) == 0 && p > base);
-
-	while (p < end && p[0] != '\n') p++;
-	p++;
-	while (compar(req, p) == 0) {
-		e = SLIST_NEXT(index_parse_line(p, e), entries);
-		r++;
-		if (e == NULL)
-			return r;
-		while (p < end && p[0] != '\n') p++;
-		p++;
-		if (p == end)
-			break;
+	for (i = 0; i < 2 * nvals; i++)
+		if (trie_get_uv(p, len, &pos, &v) == -1)
+			return -1;
+	for (i = 0, sum = nvals; i < nedges; i++) {
+		if (trie_get_uv(p, len, &pos, &lablen) == -1 ||
+		    lablen == 0 || lablen > len - pos ||
+		    lablen > maxlen - depth || p[pos] <= prev)
+			return -1;
+		prev = p[pos];
+		pos += lablen;
+		if (trie_get_uv(p, len, &pos, &cnt) == -1 ||
+		    trie_get_uv(p, len, &pos, &dist) == -1 ||
+		    cnt == 0 || cnt > count - sum || dist == 0 || dist > node ||
+		    trie_check(p, len, node - dist, lo, cnt, depth + lablen,
+		    maxlen, &lo) == -1)
+			return -1;
+		sum += cnt;
 	}
+	if (lo != node || sum != count)
+		return -1;
+	*end = pos;
+	return 0;
+}
 
-	return r;
+struct validate_job {
+	const struct dc_index	*idx;
+	struct dc_validate	 v;		/* state at line starts */
+	off_t			 slice;		/* nominal slice size */
+	off_t			*bad;		/* first bad byte per slice */
+};
+
+/*
+ * Slices start after the first newline at or behind their nominal start.
+ * If all earlier slices are fine, the line before is well formed and the
+ * digit count of its def_len is what the sequential pass would carry.
+ */
+static off_t
+index_validate_slice(const struct dc_index *idx, off_t off,
+    struct dc_validate *v)
+{
+	const char *p;
+
+	if (off == 0)
+		return 0;
+	if (off >= idx->size)
+		return idx->size;
+	if ((p = memchr(idx->data + off - 1, '\n', idx->size - off + 1)) ==
+	    NULL)
+		return idx->size;
+	off = p + 1 - idx->data;
+
+	v->v_b64chars = 0;
+	while (--p >= idx->data && *p != '\t' && *p != '\n')
+		v->v_b64chars++;
+
+	return off;
 }
 
-int
-index_prefix_find(const char *req, const struct dc_index *idx,
-    struct dc_index_list *lst)
+static void
+index_validate_work(void *arg, size_t start, size_t end, u_int worker)
 {
-	return index_find(req, idx, lst, index_prefix_cmp);
+	struct validate_job *job = arg;
+	const struct dc_index *idx = job->idx;
+	struct dc_validate v, next;
+	off_t from, to, r;
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		v = job->v;
+		from = index_validate_slice(idx, i * job->slice, &v);
+		to = index_validate_slice(idx, (i + 1) * job->slice, &next);
+		if (from >= to)
+			r = -1;
+		else if ((r = validate_text(idx->data + from, to - from,
+		    &v)) != -1)
+			r += from;
+		job->bad[i] = r;
+	}
 }
 
+/*
+ * On failure *bad is the offset of the first bad line in the text
+ * index, or -1 if the sidecar is broken.  With a pool, the text is
+ * checked in slices split at line boundaries.
+ */
 int
-index_exact_find(const char *req, const struct dc_index *idx,
-    struct dc_index_list *lst)
+index_validate(struct dc_index *idx, off_t db_size, struct dc_pool *pool,
+    off_t *bad)
+{
+	struct validate_job job;
+	const struct dc_index_rec *r;
+	const struct dc_index_sa *sa;
+	const struct dc_index_ph *ph;
+	const u_char *nodes;
+	const char *tab;
+	size_t nslices = 1, n, len, end;
+	off_t i, b = -1;
+
+	*bad = 0;
+	if (idx->size == 0)
+		return -1;
+
+	memset(&job, 0, sizeof(job));
+	job.idx = idx;
+	job.v.v_b64chars = -1;
+	for (; db_size; db_size >>= 6)
+		job.v.v_off_max++;
+	job.v.v_len_max = job.v.v_off_max;
+
+	if (pool != NULL)
+		nslices = MINIMUM(pool_size(pool) * VALIDATE_SLICES,
+		    idx->size / VALIDATE_SLICE_MIN + 1);
+	job.slice = (idx->size + nslices - 1) / nslices;
+
+	if (nslices == 1) {
+		b = validate_text(idx->data, idx->size, &job.v);
+	} else {
+		if ((job.bad = calloc(nslices, sizeof(*job.bad))) == NULL)
+			return -1;
+		pool_run(pool, index_validate_work, &job, nslices);
+		for (n = 0; n < nslices && b == -1; n++)
+			b = job.bad[n];
+		free(job.bad);
+	}
+
+	if (b == -1 && idx->data[idx->size - 1] != '\n')
+		b = idx->size - 1;
+	if (b != -1) {
+		while (b > 0 && idx->data[b - 1] != '\n')
+			b--;
+		*bad = b;
+		return -1;
+	}
+
+	*bad = -1;
+	for (i = 0; (size_t)i < idx->nrecs; i++) {
+		r = &idx->recs[i];
+		if (r->r_word >= (u_int64_t)idx->size ||
+		    r->r_word_len >= idx->size - r->r_word ||
+		    idx->data[r->r_word + r->r_word_len] != '\t')
+			return -1;
+	}
+	for (i = 0; (size_t)i < idx->nsa; i++) {
+		sa = &idx->sa[i];
+		if (sa->s_line > sa->s_suffix ||
+		    sa->s_suffix >= (u_int64_t)idx->size ||
+		    (sa->s_line > 0 && idx->data[sa->s_line - 1] != '\n'))
+			return -1;
+		tab = memchr(idx->data + sa->s_line, '\t',
+		    idx->size - sa->s_line);
+		if (tab == NULL || idx->data + sa->s_suffix >= tab)
+			return -1;
+	}
+	if (idx->trie != NULL) {
+		if ((nodes = index_trie_nodes(idx, &len)) == NULL ||
+		    idx->trie->t_maxlen > (u_int64_t)idx->size ||
+		    trie_check(nodes, len, idx->trie->t_root, 0,
+		    idx->trie->t_count, 0, idx->trie->t_maxlen, &end) == -1 ||
+		    end != len)
+			return -1;
+	}
+	if (idx->eyt != NULL && idx->recs != NULL) {
+		if (idx->neyt != idx->nrecs)
+			return -1;
+		for (n = 0; n < idx->neyt; n++) {
+			i = idx->eyt[idx->neyt + n];
+			if ((size_t)i >= idx->nrecs || idx->eyt[n] !=
+			    index_key8(idx->data + idx->recs[i].r_word, '\t'))
+				return -1;
+		}
+	}
+	if ((idx->nph & (idx->nph - 1)) != 0)
+		return -1;
+	for (i = 0; (size_t)i < idx->nph; i++) {
+		ph = &idx->ph[i];
+		if (ph->p_count == 0)
+			continue;
+		if (ph->p_line >= ph->p_end ||
+		    ph->p_end > (u_int64_t)idx->size ||
+		    (ph->p_line > 0 && idx->data[ph->p_line - 1] != '\n') ||
+		    idx->data[ph->p_end - 1] != '\n' ||
+		    (idx->recs != NULL &&
+		    (u_int64_t)ph->p_rec + ph->p_count > idx->nrecs))
+			return -1;
+	}
+	return 0;
+}
+
+/* the value of each base 64 digit, -1 for anything else */
+static const signed char index_b64[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/*
+ * Decode the base 64 number following the separator at *pp and leave
+ * *pp on the separator after it.  Digits are looked up in a table and
+ * shifted in from the front, so the field is only read once.
+ */
+static int
+index_parse_b64(const char **pp, const char *end, size_t *res)
+{
+	const u_char *p = (const u_char *)*pp + 1, *e = (const u_char *)end;
+	size_t v = 0;
+	int d;
+
+	if (p >= e || index_b64[*p] == -1)
+		return -1;
+	for (; p < e && (d = index_b64[*p]) != -1; p++) {
+		if (v >> (sizeof(v) * 8 - 6) != 0)
+			return -1;
+		v = v << 6 | d;
+	}
+	if (p >= e || (*p != '\t' && *p != '\n'))
+		return -1;
+	*res = v;
+	*pp = (const char *)p;
+	return 0;
+}
+
+/*
+ * Parse the line at p, which ends before end.  The full length of the
+ * headword is returned in *len if not NULL.  Returns the start of the
+ * next line, or NULL with errno set if the line is malformed.
+ */
+static const char *
+index_parse_line(const char *p, const char *end, struct dc_index_entry *e,
+    size_t *len)
+{
+	const char *tab, *nl;
+
+	if ((tab = memchr(p, '\t', end - p)) == NULL)
+		goto bad;
+	e->match = p;
+	e->match_len = MINIMUM((size_t)(tab - p), WORD_MAX);
+	if (len != NULL)
+		*len = tab - p;
+
+	p = tab;
+	if (index_parse_b64(&p, end, &e->def_off) == -1 || *p != '\t' ||
+	    index_parse_b64(&p, end, &e->def_len) == -1)
+		goto bad;
+	if (*p == '\n')
+		return p + 1;
+	if ((nl = memchr(p, '\n', end - p)) == NULL)
+		goto bad;
+	return nl + 1;
+ bad:
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * Parse up to n consecutive lines from p on, stopping at end.  The line
+ * ends fall out of the decoding, so the text is read once.  Returns the
+ * number of lines parsed with *next after them, or -1.
+ */
+static ssize_t
+index_parse_lines(const char *p, const char *end, struct dc_index_entry *e,
+    size_t n, const char **next)
+{
+	size_t i;
+
+	for (i = 0; i < n && p < end; i++)
+		if ((p = index_parse_line(p, end, &e[i], NULL)) == NULL)
+			return -1;
+	*next = p;
+	return i;
+}
+
+static struct dc_index_entry *
+index_parse_rec(const struct dc_index *idx, const struct dc_index_rec *r,
+    struct dc_index_entry *e)
+{
+	e->match = idx->data + r->r_word;
+	e->match_len = MINIMUM(r->r_word_len, WORD_MAX);
+	e->def_off = r->r_def_off;
+	e->def_len = r->r_def_len;
+
+	return e;
+}
+
+/*
+ * key is NUL terminated
+ * entry is HT terminated
+ */
+static int
+index_exact_cmp(const char *key, const char *entry)
+{
+	size_t klen = strlen(key), elen = 0;
+	int r;
+
+	while (entry[elen] != '\t') elen++;
+	r = strncmp(key, entry, MINIMUM(klen, elen));
+
+	if (r == 0 && klen < elen)
+		return -1;
+	else if (r == 0 && elen < klen)
+		return 1;
+	return r;
+}
+
+/*
+ * key is NUL terminated
+ * entry is HT terminated
+ */
+static int
+index_prefix_cmp(const char *key, const char *entry)
+{
+	size_t klen = strlen(key), elen = 0;
+	int r;
+
+	while (entry[elen] != '\t') elen++;
+	r = strncmp(key, entry, MINIMUM(klen, elen));
+
+	if (r == 0 && elen < klen)
+		return 1;
+	return r;
+}
+
+/*
+ * Return the start of the line following p.
+ */
+static off_t
+index_line_next(const struct dc_index *idx, off_t p)
+{
+	const char *nl;
+
+	if ((nl = memchr(idx->data + p, '\n', idx->size - p)) == NULL)
+		return idx->size;
+	return nl - idx->data + 1;
+}
+
+/*
+ * Bisect [lo, hi) for the first position whose entry is not less than
+ * key, or with upper set, greater than key.  lo must be a position,
+ * hi a position or the end.  In the text index the midpoint is moved
+ * back to the start of its line, so every line including the first can
+ * be probed.
+ */
+static off_t
+index_bound(const char *key, const struct dc_index *idx, off_t lo, off_t hi,
+    int upper, int (*compar)(const char *, const char *))
+{
+	const char *entry;
+	off_t mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->recs != NULL) {
+			entry = idx->data + idx->recs[mid].r_word;
+		} else {
+			while (mid > lo && idx->data[mid - 1] != '\n')
+				mid--;
+			entry = idx->data + mid;
+		}
+		cmp = compar(key, entry);
+		if (cmp > 0 || (upper && cmp == 0))
+			lo = idx->recs != NULL ? mid + 1 : index_line_next(idx, mid);
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Whether the entry of node k sorts before key, or with upper set, not
+ * after it.  The keys of eight bytes decide most probes without
+ * touching the headwords: if they differ within the length of key, so
+ * do the words.
+ */
+static int
+index_eyt_before(const char *key, u_int64_t k8, size_t klen,
+    const struct dc_index *idx, size_t k, int upper,
+    int (*compar)(const char *, const char *))
+{
+	u_int64_t e8 = idx->eyt[k - 1];
+	int cmp;
+
+	if (e8 < k8)
+		return 1;
+	if (e8 > k8 && (!upper || klen >= 8 ||
+	    (klen > 0 && e8 >> (64 - 8 * klen) != k8 >> (64 - 8 * klen))))
+		return 0;
+	cmp = compar(key, idx->data +
+	    idx->recs[idx->eyt[idx->neyt + k - 1]].r_word);
+	return cmp > 0 || (upper && cmp == 0);
+}
+
+/*
+ * Like index_bound() over all records, but walking the Eytzinger tree.
+ * The nodes three levels down share a cache line and are fetched while
+ * this level is compared.
+ */
+static off_t
+index_eyt_bound(const char *key, const struct dc_index *idx, int upper,
+    int (*compar)(const char *, const char *))
+{
+	u_int64_t k8 = index_key8(key, '\0');
+	size_t klen = strlen(key), n = idx->neyt, k = 1;
+
+	while (k <= n) {
+		if (8 * k <= n)
+			__builtin_prefetch(&idx->eyt[8 * k - 1]);
+		k = 2 * k + index_eyt_before(key, k8, klen, idx, k, upper,
+		    compar);
+	}
+	/* back up to the last node where the search went left */
+	while (k & 1)
+		k >>= 1;
+	k >>= 1;
+	return k == 0 ? (off_t)n : (off_t)idx->eyt[n + k - 1];
+}
+
+/*
+ * Find the positions [*first, *last) of the entries matching req.
+ * Positions are line offsets in the text index or record numbers in
+ * the sidecar, 0 is always the start.
+ */
+static void
+index_range(const char *req, const struct dc_index *idx, off_t from,
+    off_t *first, off_t *last, int (*compar)(const char *, const char *))
+{
+	off_t end = idx->recs != NULL ? (off_t)idx->nrecs : idx->size;
+
+	if (idx->eyt != NULL && idx->recs != NULL && idx->neyt == idx->nrecs) {
+		*first = index_eyt_bound(req, idx, 0, compar);
+		*last = index_eyt_bound(req, idx, 1, compar);
+		return;
+	}
+	*first = index_bound(req, idx, from, end, 0, compar);
+	*last = index_bound(req, idx, *first, end, 1, compar);
+}
+
+/*
+ * Position c on the entries matching req.  If hint is given, it is the
+ * position of an entry no greater than req, usually the first match of
+ * the previous request in a sorted batch.  The search starts there and
+ * the hint is moved to the first match of req.
+ */
+static int
+index_cursor(const char *req, const struct dc_index *idx, off_t *hint,
+    struct dc_cursor *c, int (*compar)(const char *, const char *))
+{
+	c->c_idx = idx;
+	index_range(req, idx, hint != NULL ? *hint : 0, &c->c_pos, &c->c_end,
+	    compar);
+	if (c->c_pos == c->c_end)
+		return -1;
+	if (hint != NULL)
+		*hint = c->c_pos;
+	return 0;
+}
+
+/*
+ * Parse the next match into e, NULL once the matches are exhausted.
+ */
+struct dc_index_entry *
+index_cursor_next(struct dc_cursor *c, struct dc_index_entry *e)
+{
+	const struct dc_index *idx = c->c_idx;
+	const char *next;
+
+	if (c->c_pos >= c->c_end)
+		return NULL;
+	if (idx->recs != NULL) {
+		index_parse_rec(idx, &idx->recs[c->c_pos], e);
+		c->c_pos++;
+	} else {
+		if ((next = index_parse_line(idx->data + c->c_pos,
+		    idx->data + c->c_end, e, NULL)) == NULL)
+			return NULL;
+		c->c_pos = next - idx->data;
+	}
+	return e;
+}
+
+/*
+ * Step over up to n matches without parsing them.
+ */
+size_t
+index_cursor_skip(struct dc_cursor *c, size_t n)
+{
+	const struct dc_index *idx = c->c_idx;
+	size_t i;
+
+	if (idx->recs != NULL) {
+		i = MINIMUM(n, (size_t)(c->c_end - c->c_pos));
+		c->c_pos += i;
+		return i;
+	}
+	for (i = 0; i < n && c->c_pos < c->c_end; i++)
+		c->c_pos = index_line_next(idx, c->c_pos);
+	return i;
+}
+
+/*
+ * Skip offset matches and collect the next limit of them, all if limit
+ * is 0, into lst.  The entries are allocated from a and parsed in
+ * batches, the cursor is left on the first match not collected.
+ */
+ssize_t
+index_cursor_collect(struct dc_cursor *c, size_t offset, size_t limit,
+    struct dc_arena *a, struct dc_index_list *lst)
+{
+	const struct dc_index *idx = c->c_idx;
+	struct dc_index_entry *e, *last = NULL;
+	const char *next;
+	size_t n = 0, k, i;
+	ssize_t r;
+
+	SLIST_INIT(lst);
+	index_cursor_skip(c, offset);
+	while (c->c_pos < c->c_end && (limit == 0 || n < limit)) {
+		k = INDEX_PARSE_BATCH;
+		if (limit != 0)
+			k = MINIMUM(k, limit - n);
+		if (idx->recs != NULL)
+			k = MINIMUM(k, (size_t)(c->c_end - c->c_pos));
+		else
+			k = MINIMUM(k, (size_t)(c->c_end - c->c_pos +
+			    INDEX_LINE_MIN - 1) / INDEX_LINE_MIN);
+		if ((e = arena_alloc(a, k * sizeof(*e))) == NULL)
+			return -1;
+		if (idx->recs != NULL) {
+			for (i = 0; i < k; i++)
+				index_parse_rec(idx, &idx->recs[c->c_pos + i],
+				    &e[i]);
+			c->c_pos += k;
+		} else {
+			if ((r = index_parse_lines(idx->data + c->c_pos,
+			    idx->data + c->c_end, e, k, &next)) == -1)
+				return -1;
+			k = r;
+			c->c_pos = next - idx->data;
+		}
+		for (i = 0; i < k; i++) {
+			if (last == NULL)
+				SLIST_INSERT_HEAD(lst, &e[i], entries);
+			else
+				SLIST_INSERT_AFTER(last, &e[i], entries);
+			last = &e[i];
+		}
+		n += k;
+	}
+	return n;
+}
+
+/*
+ * Count the matches without parsing them.  With the sidecar this is
+ * two bisections, the text index needs the lines in the range counted.
+ */
+static size_t
+index_count(const char *req, const struct dc_index *idx,
+    int (*compar)(const char *, const char *))
+{
+	const char *p, *end;
+	off_t first, last;
+	size_t n = 0;
+
+	index_range(req, idx, 0, &first, &last, compar);
+	if (idx->recs != NULL)
+		return last - first;
+
+	p = idx->data + first;
+	end = idx->data + last;
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Follow req down from the root, key gets the bytes on the way.  With
+ * prefix set req may end inside an edge, otherwise it must end at a
+ * node.  Returns the node and the number of entries below it.
+ */
+static int
+trie_descend(struct trie_walk *w, const struct dc_index_trie *t,
+    const char *req, int prefix, size_t *node, u_int64_t *count)
+{
+	const u_char *label = NULL;
+	size_t rlen = strlen(req), nd = t->t_root, pos, m;
+	u_int64_t nvals, nedges, i, v, lablen = 0, cnt = 0, dist = 0;
+	u_char c;
+
+	*count = t->t_count;
+	w->w_keylen = 0;
+	while (w->w_keylen < rlen) {
+		c = req[w->w_keylen];
+		pos = nd;
+		if (trie_get_node(w->w_nodes, w->w_len, &pos, &nvals,
+		    &nedges) == -1)
+			return -1;
+		for (i = 0; i < 2 * nvals; i++)
+			if (trie_get_uv(w->w_nodes, w->w_len, &pos, &v) == -1)
+				return -1;
+		for (i = 0; i < nedges; i++) {
+			if (trie_get_uv(w->w_nodes, w->w_len, &pos,
+			    &lablen) == -1 || lablen == 0 ||
+			    lablen > w->w_len - pos)
+				return -1;
+			label = w->w_nodes + pos;
+			pos += lablen;
+			if (trie_get_uv(w->w_nodes, w->w_len, &pos,
+			    &cnt) == -1 ||
+			    trie_get_uv(w->w_nodes, w->w_len, &pos,
+			    &dist) == -1)
+				return -1;
+			if (label[0] >= c)
+				break;
+		}
+		if (i == nedges || label[0] != c)
+			return -1;
+
+		for (m = 1; m < lablen && w->w_keylen + m < rlen &&
+		    label[m] == (u_char)req[w->w_keylen + m]; m++)
+			;
+		if (m < lablen && (w->w_keylen + m < rlen || !prefix))
+			return -1;
+		if (lablen > w->w_maxlen - w->w_keylen || dist > nd)
+			return -1;
+		if (w->w_key != NULL)
+			memcpy(w->w_key + w->w_keylen, label, lablen);
+		w->w_keylen += lablen;
+		nd -= dist;
+		*count = cnt;
+	}
+	*node = nd;
+	return 0;
+}
+
+static int
+trie_emit(struct trie_walk *w, u_int64_t off, u_int64_t len)
+{
+	struct dc_index_entry *e;
+	char *m;
+	size_t l = MINIMUM(w->w_keylen, WORD_MAX);
+
+	if (w->w_offset > 0) {
+		w->w_offset--;
+		return 0;
+	}
+	if ((e = arena_alloc(w->w_arena, sizeof(*e))) == NULL ||
+	    (m = arena_alloc(w->w_arena, l + 1)) == NULL)
+		return -1;
+	memcpy(m, w->w_key, l);
+	m[l] = '\0';
+	e->match = m;
+	e->match_len = l;
+	e->def_off = off;
+	e->def_len = len;
+	if (w->w_last == NULL)
+		SLIST_INSERT_HEAD(w->w_list, e, entries);
+	else
+		SLIST_INSERT_AFTER(w->w_last, e, entries);
+	w->w_last = e;
+	w->w_n++;
+	return 0;
+}
+
+/*
+ * Emit the entries at node and, with children set, below it in index
+ * order.  Subtrees that lie entirely within the offset are skipped by
+ * their count and the walk stops once the limit is reached, so paging
+ * and the first few completions of a short prefix stay cheap.
+ */
+static int
+trie_walk(struct trie_walk *w, size_t node, int children)
+{
+	const u_char *label;
+	size_t pos = node, keylen = w->w_keylen;
+	u_int64_t nvals, nedges, i, off, len, lablen, cnt, dist;
+
+	if (trie_get_node(w->w_nodes, w->w_len, &pos, &nvals, &nedges) == -1)
+		goto bad;
+	for (i = 0; i < nvals; i++) {
+		if (trie_get_uv(w->w_nodes, w->w_len, &pos, &off) == -1 ||
+		    trie_get_uv(w->w_nodes, w->w_len, &pos, &len) == -1)
+			goto bad;
+		if (w->w_limit != 0 && w->w_n == w->w_limit)
+			return 0;
+		if (trie_emit(w, off, len) == -1)
+			return -1;
+	}
+	if (!children)
+		return 0;
+	for (i = 0; i < nedges; i++) {
+		if (w->w_limit != 0 && w->w_n == w->w_limit)
+			break;
+		if (trie_get_uv(w->w_nodes, w->w_len, &pos, &lablen) == -1 ||
+		    lablen > w->w_len - pos)
+			goto bad;
+		label = w->w_nodes + pos;
+		pos += lablen;
+		if (trie_get_uv(w->w_nodes, w->w_len, &pos, &cnt) == -1 ||
+		    trie_get_uv(w->w_nodes, w->w_len, &pos, &dist) == -1)
+			goto bad;
+		if (w->w_offset >= cnt) {
+			w->w_offset -= cnt;
+			continue;
+		}
+		if (lablen > w->w_maxlen - keylen || dist == 0 || dist > node)
+			goto bad;
+		memcpy(w->w_key + keylen, label, lablen);
+		w->w_keylen = keylen + lablen;
+		if (trie_walk(w, node - dist, 1) == -1)
+			return -1;
+	}
+	w->w_keylen = keylen;
+	return 0;
+ bad:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Exact or prefix matches straight from the trie sidecar, in index
+ * order.  The headwords are copied to the arena.
+ */
+static ssize_t
+index_trie_find(const char *req, const struct dc_index *idx, int prefix,
+    size_t offset, size_t limit, struct dc_arena *a,
+    struct dc_index_list *lst)
+{
+	struct trie_walk w;
+	size_t node;
+	u_int64_t count;
+
+	SLIST_INIT(lst);
+	memset(&w, 0, sizeof(w));
+	w.w_nodes = index_trie_nodes(idx, &w.w_len);
+	w.w_maxlen = idx->trie->t_maxlen;
+	w.w_offset = offset;
+	w.w_limit = limit;
+	w.w_arena = a;
+	w.w_list = lst;
+	if ((w.w_key = arena_alloc(a, w.w_maxlen + 1)) == NULL)
+		return -1;
+	if (trie_descend(&w, idx->trie, req, prefix, &node, &count) == -1 ||
+	    count <= offset)
+		return 0;
+	if (trie_walk(&w, node, prefix) == -1)
+		return -1;
+	return w.w_n;
+}
+
+static size_t
+index_trie_count(const char *req, const struct dc_index *idx, int prefix)
+{
+	struct trie_walk w;
+	size_t node, pos;
+	u_int64_t count, nedges;
+
+	memset(&w, 0, sizeof(w));
+	w.w_nodes = index_trie_nodes(idx, &w.w_len);
+	w.w_maxlen = idx->trie->t_maxlen;
+	if (trie_descend(&w, idx->trie, req, prefix, &node, &count) == -1)
+		return 0;
+	pos = node;
+	if (!prefix && trie_get_node(w.w_nodes, w.w_len, &pos, &count,
+	    &nedges) == -1)
+		return 0;
+	return count;
+}
+
+/*
+ * Find the headword in the hash table, one hash and usually one
+ * comparison.
+ */
+static const struct dc_index_ph *
+index_ph_find(const char *req, const struct dc_index *idx)
+{
+	const struct dc_index_ph *ph;
+	u_int64_t h;
+	size_t mask = idx->nph - 1, i, n;
+
+	h = index_hash(req, strlen(req));
+	for (i = h & mask, n = 0; n < idx->nph; i = (i + 1) & mask, n++) {
+		ph = &idx->ph[i];
+		if (ph->p_count == 0)
+			break;
+		if (ph->p_hash == h &&
+		    index_exact_cmp(req, idx->data + ph->p_line) == 0)
+			return ph;
+	}
+	return NULL;
+}
+
+int
+index_exact_cursor(const char *req, const struct dc_index *idx,
+    struct dc_cursor *c)
+{
+	const struct dc_index_ph *ph;
+
+	if (idx->ph == NULL)
+		return index_cursor(req, idx, NULL, c, index_exact_cmp);
+
+	c->c_idx = idx;
+	if ((ph = index_ph_find(req, idx)) == NULL) {
+		c->c_pos = c->c_end = 0;
+		return -1;
+	}
+	if (idx->recs != NULL) {
+		c->c_pos = ph->p_rec;
+		c->c_end = ph->p_rec + ph->p_count;
+	} else {
+		c->c_pos = ph->p_line;
+		c->c_end = ph->p_end;
+	}
+	return 0;
+}
+
+int
+index_prefix_cursor(const char *req, const struct dc_index *idx,
+    struct dc_cursor *c)
+{
+	return index_cursor(req, idx, NULL, c, index_prefix_cmp);
+}
+
+int
+index_prefix_cursor_from(const char *req, const struct dc_index *idx,
+    off_t *hint, struct dc_cursor *c)
+{
+	return index_cursor(req, idx, hint, c, index_prefix_cmp);
+}
+
+size_t
+index_exact_count(const char *req, const struct dc_index *idx)
+{
+	const struct dc_index_ph *ph;
+
+	size_t len;
+
+	if (idx->ph != NULL)
+		return (ph = index_ph_find(req, idx)) != NULL ?
+		    ph->p_count : 0;
+	if (index_trie_nodes(idx, &len) != NULL)
+		return index_trie_count(req, idx, 0);
+	return index_count(req, idx, index_exact_cmp);
+}
+
+size_t
+index_prefix_count(const char *req, const struct dc_index *idx)
+{
+	size_t len;
+
+	if (index_trie_nodes(idx, &len) != NULL)
+		return index_trie_count(req, idx, 1);
+	return index_count(req, idx, index_prefix_cmp);
+}
+
+/*
+ * Collect the matches of a request, skipping offset of them and at most
+ * limit if not 0.  Exact matches come from the hash table, then the
+ * trie and only then the text index.
+ */
+ssize_t
+index_exact_find(const char *req, const struct dc_index *idx,
+    size_t offset, size_t limit, struct dc_arena *a,
+    struct dc_index_list *lst)
+{
+	struct dc_cursor c;
+	size_t len;
+
+	if (idx->ph == NULL && index_trie_nodes(idx, &len) != NULL)
+		return index_trie_find(req, idx, 0, offset, limit, a, lst);
+	SLIST_INIT(lst);
+	if (index_exact_cursor(req, idx, &c) == -1)
+		return 0;
+	return index_cursor_collect(&c, offset, limit, a, lst);
+}
+
+struct dc_complete *
+index_complete_open(const struct dc_index *idx)
+{
+	struct dc_complete *cp;
+
+	if ((cp = calloc(1, sizeof(*cp))) == NULL)
+		return NULL;
+	cp->cp_idx = idx;
+	cp->cp_size = 64;
+	if ((cp->cp_word = malloc(cp->cp_size)) == NULL ||
+	    (cp->cp_ranges = calloc(cp->cp_size,
+	    sizeof(*cp->cp_ranges))) == NULL) {
+		index_complete_close(cp);
+		return NULL;
+	}
+	cp->cp_word[0] = '\0';
+	cp->cp_ranges[0].r_first = 0;
+	cp->cp_ranges[0].r_last = idx->recs != NULL ?
+	    (off_t)idx->nrecs : idx->size;
+	return cp;
+}
+
+/*
+ * Position c on the entries starting with prefix.  The session keeps
+ * the range of every prefix of the previous request: characters that
+ * were deleted cost nothing, each added one is searched for inside the
+ * range of the one before.  Collecting the first few entries from c
+ * gives the top completions without touching the rest of the range.
+ * Returns -1 only if memory runs out, c may well be empty.
+ */
+int
+index_complete(struct dc_complete *cp, const char *prefix,
+    struct dc_cursor *c)
+{
+	const struct dc_index *idx = cp->cp_idx;
+	struct complete_range *r, *nr;
+	size_t len = strlen(prefix), size, i;
+	char *nw;
+
+	for (i = 0; i < cp->cp_len && cp->cp_word[i] == prefix[i]; i++)
+		;
+	cp->cp_len = i;
+
+	if (len >= cp->cp_size) {
+		for (size = cp->cp_size; size <= len; size *= 2)
+			;
+		if ((nw = realloc(cp->cp_word, size)) == NULL)
+			return -1;
+		cp->cp_word = nw;
+		if ((nr = reallocarray(cp->cp_ranges, size,
+		    sizeof(*nr))) == NULL)
+			return -1;
+		cp->cp_ranges = nr;
+		cp->cp_size = size;
+	}
+
+	for (; cp->cp_len < len; cp->cp_len++) {
+		r = &cp->cp_ranges[cp->cp_len];
+		nr = r + 1;
+		cp->cp_word[cp->cp_len] = prefix[cp->cp_len];
+		cp->cp_word[cp->cp_len + 1] = '\0';
+		if (r->r_first == r->r_last) {
+			*nr = *r;
+			continue;
+		}
+		nr->r_first = index_bound(cp->cp_word, idx, r->r_first,
+		    r->r_last, 0, index_prefix_cmp);
+		nr->r_last = index_bound(cp->cp_word, idx, nr->r_first,
+		    r->r_last, 1, index_prefix_cmp);
+	}
+	cp->cp_word[len] = '\0';
+
+	c->c_idx = idx;
+	c->c_pos = cp->cp_ranges[len].r_first;
+	c->c_end = cp->cp_ranges[len].r_last;
+	return 0;
+}
+
+void
+index_complete_close(struct dc_complete *cp)
+{
+	if (cp == NULL)
+		return;
+	free(cp->cp_word);
+	free(cp->cp_ranges);
+	free(cp);
+}
+
+/*
+ * Like index_exact_find(), but the trie is used first.  Without it the
+ * search starts at *hint if not NULL.
+ */
+ssize_t
+index_prefix_find(const char *req, const struct dc_index *idx,
+    off_t *hint, size_t offset, size_t limit, struct dc_arena *a,
+    struct dc_index_list *lst)
+{
+	struct dc_cursor c;
+	size_t len;
+	int r;
+
+	if (index_trie_nodes(idx, &len) != NULL)
+		return index_trie_find(req, idx, 1, offset, limit, a, lst);
+	SLIST_INIT(lst);
+	if (hint != NULL)
+		r = index_prefix_cursor_from(req, idx, hint, &c);
+	else
+		r = index_prefix_cursor(req, idx, &c);
+	if (r == -1)
+		return 0;
+	return index_cursor_collect(&c, offset, limit, a, lst);
+}
+
+/*
+ * The headword at pos and its length.
+ */
+static const char *
+index_word(const struct dc_index *idx, off_t pos, size_t *len)
+{
+	const char *w, *tab;
+
+	if (idx->recs != NULL) {
+		*len = idx->recs[pos].r_word_len;
+		return idx->data + idx->recs[pos].r_word;
+	}
+	w = idx->data + pos;
+	tab = memchr(w, '\t', idx->size - pos);
+	*len = tab - w;
+	return w;
+}
+
+static int
+lev_hit_cmp(const void *a, const void *b)
+{
+	const struct lev_hit *ha = a, *hb = b;
+
+	if (ha->h_dist != hb->h_dist)
+		return ha->h_dist < hb->h_dist ? -1 : 1;
+	return (ha->h_pos > hb->h_pos) - (ha->h_pos < hb->h_pos);
+}
+
+/*
+ * Walk the sorted entries of a slice like the paths of a trie.  Row d of
+ * the matrix holds the distances between key and the first d bytes of
+ * the headword, so neighbours reuse the rows of their common prefix.
+ * Once a row has no distance within maxd, no headword with that prefix
+ * can match and the search bisects past all of them.
+ */
+static void
+index_lev_slice(struct lev_job *job, struct lev_slice *sl)
+{
+	const struct dc_index *idx = job->idx;
+	const char *key = job->key, *w, *pw = NULL;
+	size_t klen = job->klen, cols = klen + 1, wlen, valid = 0, d, j;
+	u_int *m, *prev, *cur, maxd = job->maxd, min, v;
+	struct lev_hit *h;
+	char *pfx;
+	off_t pos = sl->s_from;
+
+	/* rows past klen + maxd cannot be within maxd */
+	m = reallocarray(NULL, klen + maxd + 2, cols * sizeof(*m));
+	pfx = malloc(klen + maxd + 2);
+	if (m == NULL || pfx == NULL) {
+		sl->s_error = 1;
+		goto done;
+	}
+	for (j = 0; j < cols; j++)
+		m[j] = j;
+
+	while (pos < sl->s_to) {
+		w = index_word(idx, pos, &wlen);
+		for (d = 0; d < valid && d < wlen && pw[d] == w[d]; d++)
+			;
+		for (d++; d <= wlen; d++) {
+			prev = m + (d - 1) * cols;
+			cur = prev + cols;
+			cur[0] = min = d;
+			for (j = 1; j < cols; j++) {
+				v = prev[j - 1] + (w[d - 1] != key[j - 1]);
+				v = MINIMUM(v, prev[j] + 1);
+				v = MINIMUM(v, cur[j - 1] + 1);
+				cur[j] = v;
+				min = MINIMUM(min, v);
+			}
+			if (min > maxd)
+				break;
+		}
+		pw = w;
+
+		if (d <= wlen) {
+			memcpy(pfx, w, d);
+			pfx[d] = '\0';
+			valid = d - 1;
+			pos = index_bound(pfx, idx, pos, sl->s_to, 1,
+			    index_prefix_cmp);
+			continue;
+		}
+		valid = wlen;
+
+		if (m[wlen * cols + klen] <= maxd) {
+			if (sl->s_nhits == sl->s_max) {
+				sl->s_max = MAXIMUM(64, sl->s_max * 2);
+				h = reallocarray(sl->s_hits, sl->s_max,
+				    sizeof(*h));
+				if (h == NULL) {
+					sl->s_error = 1;
+					goto done;
+				}
+				sl->s_hits = h;
+			}
+			h = &sl->s_hits[sl->s_nhits++];
+			h->h_pos = pos;
+			h->h_dist = m[wlen * cols + klen];
+		}
+		pos = idx->recs != NULL ? pos + 1 : index_line_next(idx, pos);
+	}
+
+ done:
+	free(pfx);
+	free(m);
+}
+
+static void
+index_lev_work(void *arg, size_t start, size_t end, u_int worker)
+{
+	struct lev_job *job = arg;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		index_lev_slice(job, &job->slices[i]);
+}
+
+/*
+ * Collect the entries within Levenshtein distance maxd of req into lst,
+ * closest first and in index order otherwise.  With a pool, large
+ * indexes are searched in slices.
+ */
+ssize_t
+index_lev_find(const char *req, const struct dc_index *idx, u_int maxd,
+    struct dc_pool *pool, struct dc_arena *a, struct dc_index_list *lst)
+{
+	struct lev_job job;
+	struct lev_hit *hits = NULL;
+	struct dc_index_entry *e, *last = NULL;
+	struct dc_cursor c;
+	off_t end, b;
+	size_t nslices = 1, nhits = 0, i;
+	ssize_t r = -1;
+
+	SLIST_INIT(lst);
+	if (idx->recs != NULL) {
+		end = idx->nrecs;
+		b = LEV_SLICE_RECS;
+	} else {
+		end = idx->size;
+		b = LEV_SLICE_MIN;
+	}
+	if (pool != NULL)
+		nslices = MINIMUM(pool_size(pool) * LEV_SLICES, end / b + 1);
+
+	job.idx = idx;
+	job.key = req;
+	job.klen = strlen(req);
+	job.maxd = maxd;
+	if ((job.slices = calloc(nslices, sizeof(*job.slices))) == NULL)
+		return -1;
+	for (i = 0; i < nslices; i++) {
+		b = end / nslices * (i + 1);
+		if (i == nslices - 1)
+			b = end;
+		else if (idx->recs == NULL && b > 0 && idx->data[b - 1] != '\n')
+			b = index_line_next(idx, b);
+		job.slices[i].s_from = i == 0 ? 0 : job.slices[i - 1].s_to;
+		job.slices[i].s_to = MAXIMUM(b, job.slices[i].s_from);
+	}
+
+	if (nslices == 1)
+		index_lev_slice(&job, &job.slices[0]);
+	else
+		pool_run(pool, index_lev_work, &job, nslices);
+
+	for (i = 0; i < nslices; i++) {
+		if (job.slices[i].s_error)
+			goto done;
+		nhits += job.slices[i].s_nhits;
+	}
+	if ((hits = calloc(MAXIMUM(nhits, 1), sizeof(*hits))) == NULL)
+		goto done;
+	for (nhits = 0, i = 0; i < nslices; i++) {
+		memcpy(hits + nhits, job.slices[i].s_hits,
+		    job.slices[i].s_nhits * sizeof(*hits));
+		nhits += job.slices[i].s_nhits;
+	}
+	qsort(hits, nhits, sizeof(*hits), lev_hit_cmp);
+
+	c.c_idx = idx;
+	for (i = 0; i < nhits; i++) {
+		if ((e = arena_alloc(a, sizeof(*e))) == NULL)
+			goto done;
+		c.c_pos = hits[i].h_pos;
+		c.c_end = idx->recs != NULL ? c.c_pos + 1 :
+		    index_line_next(idx, c.c_pos);
+		if (index_cursor_next(&c, e) == NULL)
+			goto done;
+		if (last == NULL)
+			SLIST_INSERT_HEAD(lst, e, entries);
+		else
+			SLIST_INSERT_AFTER(last, e, entries);
+		last = e;
+	}
+	r = nhits;
+
+ done:
+	for (i = 0; i < nslices; i++)
+		free(job.slices[i].s_hits);
+	free(job.slices);
+	free(hits);
+	return r;
+}
+
+static int
+index_off_cmp(const void *a, const void *b)
+{
+	u_int64_t oa = *(const u_int64_t *)a, ob = *(const u_int64_t *)b;
+
+	return (oa > ob) - (oa < ob);
+}
+
+/*
+ * Collect the lines containing req, or ending in it if suffix is set,
+ * into lst in index order.  The suffix array gives the matching
+ * suffixes as one range, without it every headword is scanned.
+ */
+static ssize_t
+index_sa_find(const char *req, const struct dc_index *idx, int suffix,
+    struct dc_arena *a, struct dc_index_list *lst)
+{
+	int (*compar)(const char *, const char *);
+	struct dc_index_entry *e, *last = NULL;
+	const char *w;
+	u_int64_t *lines = NULL;
+	off_t pos;
+	size_t klen = strlen(req), lo, hi, first, mid, nlines = 0, i, l;
+	ssize_t r = -1;
+
+	SLIST_INIT(lst);
+	if (idx->sa == NULL) {
+		for (pos = 0; pos < idx->size; pos = index_line_next(idx, pos)) {
+			w = idx->data + pos;
+			l = (const char *)memchr(w, '\t', idx->size - pos) - w;
+			if (suffix ? l < klen ||
+			    memcmp(w + l - klen, req, klen) != 0 :
+			    memmem(w, l, req, klen) == NULL)
+				continue;
+			if ((e = arena_alloc(a, sizeof(*e))) == NULL ||
+			    index_parse_line(w, idx->data + idx->size, e,
+			    NULL) == NULL)
+				return -1;
+			if (last == NULL)
+				SLIST_INSERT_HEAD(lst, e, entries);
+			else
+				SLIST_INSERT_AFTER(last, e, entries);
+			last = e;
+			nlines++;
+		}
+		return nlines;
+	}
+
+	compar = suffix ? index_exact_cmp : index_prefix_cmp;
+	for (lo = 0, hi = idx->nsa; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (compar(req, idx->data + idx->sa[mid].s_suffix) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (first = lo, hi = idx->nsa; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (compar(req, idx->data + idx->sa[mid].s_suffix) >= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (first == lo)
+		return 0;
+
+	/* a headword may contain req more than once */
+	if ((lines = calloc(lo - first, sizeof(*lines))) == NULL)
+		return -1;
+	for (i = first; i < lo; i++)
+		lines[i - first] = idx->sa[i].s_line;
+	qsort(lines, lo - first, sizeof(*lines), index_off_cmp);
+	for (i = 0; i < lo - first; i++) {
+		if (i > 0 && lines[i] == lines[i - 1])
+			continue;
+		if ((e = arena_alloc(a, sizeof(*e))) == NULL ||
+		    index_parse_line(idx->data + lines[i],
+		    idx->data + idx->size, e, NULL) == NULL)
+			goto done;
+		if (last == NULL)
+			SLIST_INSERT_HEAD(lst, e, entries);
+		else
+			SLIST_INSERT_AFTER(last, e, entries);
+		last = e;
+		nlines++;
+	}
+	r = nlines;
+ done:
+	free(lines);
+	return r;
+}
+
+ssize_t
+index_substring_find(const char *req, const struct dc_index *idx,
+    struct dc_arena *a, struct dc_index_list *lst)
+{
+	return index_sa_find(req, idx, 0, a, lst);
+}
+
+ssize_t
+index_suffix_find(const char *req, const struct dc_index *idx,
+    struct dc_arena *a, struct dc_index_list *lst)
+{
+	return index_sa_find(req, idx, 1, a, lst);
+}
+
+/*
+ * The literal every match of a glob starts with.
+ */
+static void
+index_glob_prefix(const char *pat, char *buf)
+{
+	size_t l;
+
+	for (l = 0; pat[l] != '\0' && strchr("*?[\\", pat[l]) == NULL; l++)
+		buf[l] = pat[l];
+	buf[l] = '\0';
+}
+
+/*
+ * The literal every match of an extended regular expression starts
+ * with, if it is anchored and has no alternation.
+ */
+static void
+index_re_prefix(const char *pat, char *buf)
+{
+	size_t l = 0;
+
+	if (pat[0] == '^' && strchr(pat, '|') == NULL) {
+		for (pat++; *pat != '\0' &&
+		    strchr(".[]()*+?{}|\\^$", *pat) == NULL; pat++)
+			buf[l++] = *pat;
+		/* a quantifier makes the last literal optional */
+		if (l > 0 && (*pat == '*' || *pat == '?' || *pat == '{'))
+			l--;
+	}
+	buf[l] = '\0';
+}
+
+/*
+ * Match the headwords in the range of the literal prefix against a
+ * regular expression or a glob, collecting the matches into lst in
+ * index order.  A bad pattern fails with EINVAL.
+ */
+static ssize_t
+index_pattern_find(const char *req, const struct dc_index *idx, int glob,
+    struct dc_arena *a, struct dc_index_list *lst)
+{
+	struct dc_index_entry *e, *last = NULL;
+	struct dc_cursor c;
+	regmatch_t m;
+	regex_t re;
+	const char *w;
+	char *pfx, buf[WORD_MAX + 1];
+	size_t l;
+	ssize_t n = 0;
+	int match;
+
+	SLIST_INIT(lst);
+	if ((pfx = malloc(strlen(req) + 1)) == NULL)
+		return -1;
+	if (glob) {
+		index_glob_prefix(req, pfx);
+	} else {
+		index_re_prefix(req, pfx);
+		if (regcomp(&re, req, REG_EXTENDED | REG_NOSUB) != 0) {
+			free(pfx);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	c.c_idx = idx;
+	index_range(pfx, idx, 0, &c.c_pos, &c.c_end, index_prefix_cmp);
+	while (c.c_pos < c.c_end) {
+		w = index_word(idx, c.c_pos, &l);
+		if (glob) {
+			l = MINIMUM(l, WORD_MAX);
+			memcpy(buf, w, l);
+			buf[l] = '\0';
+			match = fnmatch(req, buf, 0) == 0;
+		} else {
+			m.rm_so = 0;
+			m.rm_eo = l;
+			match = regexec(&re, w, 1, &m, REG_STARTEND) == 0;
+		}
+		if (!match) {
+			index_cursor_skip(&c, 1);
+			continue;
+		}
+		if ((e = arena_alloc(a, sizeof(*e))) == NULL ||
+		    index_cursor_next(&c, e) == NULL) {
+			n = -1;
+			break;
+		}
+		if (last == NULL)
+			SLIST_INSERT_HEAD(lst, e, entries);
+		else
+			SLIST_INSERT_AFTER(last, e, entries);
+		last = e;
+		n++;
+	}
+
+	if (!glob)
+		regfree(&re);
+	free(pfx);
+	return n;
+}
+
+ssize_t
+index_re_find(const char *req, const struct dc_index *idx,
+    struct dc_arena *a, struct dc_index_list *lst)
+{
+	return index_pattern_find(req, idx, 0, a, lst);
+}
+
+ssize_t
+index_glob_find(const char *req, const struct dc_index *idx,
+    struct dc_arena *a, struct dc_index_list *lst)
 {
-	return index_find(req, idx, lst, index_exact_cmp);
+	return index_pattern_find(req, idx, 1, a, lst);
 }
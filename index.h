@@ -14,9 +14,45 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+struct dc_arena;
+struct dc_complete;
+struct dc_pool;
+
 int index_open(char *, struct dc_index *);
-int index_validate(struct dc_index *, off_t);
-int index_exact_find(const char *, const struct dc_index *,
-    struct dc_index_list *);
-int index_prefix_find(const char *, const struct dc_index *,
-    struct dc_index_list *);
+int index_build(char *, const struct dc_index *);
+const void *index_records(const struct dc_index *, size_t *);
+const void *index_suffixes(const struct dc_index *, size_t *);
+const void *index_hashes(const struct dc_index *, size_t *);
+const void *index_trie(const struct dc_index *, size_t *);
+const void *index_layout(const struct dc_index *, size_t *);
+int index_validate(struct dc_index *, off_t, struct dc_pool *, off_t *);
+int index_exact_cursor(const char *, const struct dc_index *,
+    struct dc_cursor *);
+int index_prefix_cursor(const char *, const struct dc_index *,
+    struct dc_cursor *);
+int index_prefix_cursor_from(const char *, const struct dc_index *,
+    off_t *, struct dc_cursor *);
+struct dc_index_entry *index_cursor_next(struct dc_cursor *,
+    struct dc_index_entry *);
+size_t index_cursor_skip(struct dc_cursor *, size_t);
+ssize_t index_cursor_collect(struct dc_cursor *, size_t, size_t,
+    struct dc_arena *, struct dc_index_list *);
+ssize_t index_exact_find(const char *, const struct dc_index *, size_t,
+    size_t, struct dc_arena *, struct dc_index_list *);
+ssize_t index_prefix_find(const char *, const struct dc_index *, off_t *,
+    size_t, size_t, struct dc_arena *, struct dc_index_list *);
+struct dc_complete *index_complete_open(const struct dc_index *);
+int index_complete(struct dc_complete *, const char *, struct dc_cursor *);
+void index_complete_close(struct dc_complete *);
+size_t index_exact_count(const char *, const struct dc_index *);
+size_t index_prefix_count(const char *, const struct dc_index *);
+ssize_t index_lev_find(const char *, const struct dc_index *, u_int,
+    struct dc_pool *, struct dc_arena *, struct dc_index_list *);
+ssize_t index_substring_find(const char *, const struct dc_index *,
+    struct dc_arena *, struct dc_index_list *);
+ssize_t index_suffix_find(const char *, const struct dc_index *,
+    struct dc_arena *, struct dc_index_list *);
+ssize_t index_re_find(const char *, const struct dc_index *,
+    struct dc_arena *, struct dc_index_list *);
+ssize_t index_glob_find(const char *, const struct dc_index *,
+    struct dc_arena *, struct dc_index_list *);
@@ -17,23 +17,91 @@
 #include <sys/mman.h>
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "dict.h"
 #include "database.h"
 #include "index.h"
+#include "pool.h"
+#include "repack.h"
+#include "server.h"
+#include "vcache.h"
 
-#define MAX_RESULTS	1000
+#ifndef DICT_DIR
+#define DICT_DIR	"/usr/local/freedict"
+#endif
+#define THREADS_MAX	256
+
+static const struct strategy {
+	const char	*name;
+	ssize_t		(*find)(const char *, const struct dc_index *,
+			    struct dc_arena *, struct dc_index_list *);
+} strategies[] = {
+	{ "glob",	index_glob_find },
+	{ "re",		index_re_find },
+	{ "substring",	index_substring_find },
+	{ "suffix",	index_suffix_find },
+};
+#define NSTRATEGIES	(sizeof(strategies) / sizeof(strategies[0]))
+
+/*
+ * A lookup over several databases runs one database per pool worker,
+ * each with an arena of its own, and is printed in database order.
+ */
+struct fed_db {
+	struct dc_database	*f_db;
+	struct dc_arena		*f_arena;
+	struct dc_index_list	 f_list;
+	struct dc_lookup	*f_defs;	/* if prefetched */
+	size_t			 f_n;
+	const char		*f_error;	/* what failed */
+	int			 f_errno;
+};
+
+struct fed_job {
+	const char		*word;
+	const struct strategy	*st;
+	struct dc_pool		*pool;		/* for a single database */
+	struct fed_db		*f;
+	size_t			 offset;
+	size_t			 limit;
+	u_int			 lev;
+	int			 eflag;
+	int			 nflag;
+	int			 prefetch;	/* read the definitions */
+};
+
+struct batch_word {
+	char			*word;
+	size_t			 line;		/* input order */
+	struct dc_index_list	 res;
+	struct dc_lookup	*defs;
+	int			 nres;
+};
 
 static __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: dict -D database [-Vdm] word\n");
+	fprintf(stderr, "usage: dict -D database [-MVdmv] [-c chunks] "
+	    "[-j threads] [-L limit] [-o offset]\n"
+	    "            [-z codec] -f file | word\n"
+	    "       dict -D database -B [-j threads]\n"
+	    "       dict -D database -R length [-123456789] [-j threads]\n"
+	    "       dict -D database -n [-V] [-j threads] word\n"
+	    "       dict -D database -e distance [-MVdmv] [-j threads] word\n"
+	    "       dict -D database -s strategy [-MVdmv] word\n"
+	    "       dict -S [-MV] [-c chunks] [-D database] [-e distance] "
+	    "[-j threads]\n"
+	    "            [-l address] [-p port] [-u socket] [-z codec]\n");
 	exit(1);
 }
 
@@ -45,9 +113,6 @@ match(struct dc_index_list *l)
 	int prev_len = 0;
 
 	SLIST_FOREACH(e, l, entries) {
-		if (e->match == NULL)
-			break;
-
 		if (prev_len > 0 && prev_len == e->match_len
 		    && strncmp(prev_match, e->match, prev_len) == 0)
 			continue;
@@ -59,52 +124,487 @@ match(struct dc_index_list *l)
 }
 
 static void
-define(struct dc_database *db, struct dc_index_list *l)
+define(struct dc_database *db, struct dc_index_list *l,
+    struct dc_pool *pool)
+{
+	if (fflush(stdout) == EOF)
+		err(1, "stdout");
+	if (database_write(STDOUT_FILENO, db, l, "- ", pool) == -1)
+		err(1, "database_write");
+}
+
+static int
+batch_cmp_word(const void *a, const void *b)
+{
+	const struct batch_word *wa = a, *wb = b;
+	int r;
+
+	if ((r = strcmp(wa->word, wb->word)) != 0)
+		return r;
+	return (wa->line > wb->line) - (wa->line < wb->line);
+}
+
+static int
+batch_cmp_line(const void *a, const void *b)
+{
+	const struct batch_word *wa = a, *wb = b;
+
+	return (wa->line > wb->line) - (wa->line < wb->line);
+}
+
+static int
+batch_cmp_off(const void *a, const void *b)
 {
-	char buf[LOOKUP_MAX];
+	const struct dc_lookup *la = *(struct dc_lookup * const *)a;
+	const struct dc_lookup *lb = *(struct dc_lookup * const *)b;
+
+	return (la->req->def_off > lb->req->def_off) -
+	    (la->req->def_off < lb->req->def_off);
+}
+
+/*
+ * Read the words to look up from fp, one per line.
+ */
+static struct batch_word *
+batch_read(FILE *fp, size_t *nwordsp)
+{
+	struct batch_word *words = NULL, *w;
+	char *line = NULL;
+	size_t linesize = 0, nwords = 0, maxwords = 0;
+	ssize_t linelen;
+	int j;
+
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen == 0)
+			continue;
+		if (nwords == maxwords) {
+			maxwords = MAXIMUM(64, maxwords * 2);
+			words = reallocarray(words, maxwords, sizeof(*words));
+			if (words == NULL)
+				err(1, "reallocarray");
+		}
+		w = &words[nwords];
+		memset(w, 0, sizeof(*w));
+		w->line = nwords++;
+		if ((w->word = strdup(line)) == NULL)
+			err(1, "strdup");
+		for (j = 0; w->word[j] != '\0'; j++)
+			w->word[j] = tolower((unsigned char)w->word[j]);
+	}
+	if (ferror(fp))
+		err(1, "getline");
+	free(line);
+
+	*nwordsp = nwords;
+	return words;
+}
+
+/*
+ * Look up the words in db.  The words are sorted so the index is walked
+ * front to back once, definitions are read in file order so each chunk
+ * is inflated once per worker, and the results are printed in input
+ * order.  offset and limit apply to each word.
+ */
+static void
+batch(struct batch_word *words, size_t nwords, struct dc_database *db,
+    struct dc_arena *a, struct dc_pool *pool, size_t offset, size_t limit,
+    int mflag, int dflag)
+{
+	struct batch_word *w;
+	struct dc_lookup **defs = NULL, **d;
 	struct dc_index_entry *e;
+	off_t hint = 0;
+	size_t ndefs = 0, i;
+	ssize_t r;
+	int j;
+
+	arena_reset(a);
+	qsort(words, nwords, sizeof(*words), batch_cmp_word);
+	for (i = 0; i < nwords; i++) {
+		w = &words[i];
+		SLIST_INIT(&w->res);
+		w->defs = NULL;
+		w->nres = 0;
+		if ((r = index_prefix_find(w->word, &db->index, &hint,
+		    offset, limit, a, &w->res)) == -1)
+			err(1, "index_prefix_find");
+		if (r == 0)
+			continue;
+		if ((w->defs = calloc(r, sizeof(*w->defs))) == NULL)
+			err(1, "calloc");
+		w->nres = r;
+		ndefs += r;
+	}
+
+	if (dflag && ndefs > 0) {
+		if ((defs = calloc(ndefs, sizeof(*defs))) == NULL)
+			err(1, "calloc");
+		d = defs;
+		for (i = 0; i < nwords; i++) {
+			w = &words[i];
+			j = 0;
+			SLIST_FOREACH(e, &w->res, entries) {
+				*d = &w->defs[j++];
+				(*d)->req = e;
+				if (((*d)->out = arena_alloc(a,
+				    e->def_len)) == NULL)
+					err(1, "arena_alloc");
+				d++;
+			}
+		}
+		qsort(defs, ndefs, sizeof(*defs), batch_cmp_off);
+		if (database_lookup_pool(db, pool, defs, ndefs) == -1)
+			err(1, "database_lookup_pool");
+		for (i = 0; i < ndefs; i++)
+			if (defs[i]->len == -1)
+				errx(1, "database_lookup failed for: %.*s\n",
+				    defs[i]->req->match_len,
+				    defs[i]->req->match);
+		free(defs);
+	}
+
+	qsort(words, nwords, sizeof(*words), batch_cmp_line);
+	for (i = 0; i < nwords; i++) {
+		w = &words[i];
+		printf("# %s\n", w->word);
+		if (mflag)
+			match(&w->res);
+		if (dflag)
+			for (j = 0; j < w->nres; j++) {
+				fputs("- ", stdout);
+				fwrite(w->defs[j].out, 1, w->defs[j].len,
+				    stdout);
+			}
+		free(w->defs);
+	}
+}
+
+static char *
+dict_path(const char *name, const char *suffix)
+{
+	char *path;
+
+	if (asprintf(&path, DICT_DIR "/%s/%s%s", name, name, suffix) == -1)
+		err(1, "asprintf");
+	return path;
+}
+
+static int
+open_database(const char *name, struct dc_database *db, size_t cache)
+{
+	char *db_path, *idx_path;
 	int r;
 
-	SLIST_FOREACH(e, l, entries) {
-		if (e->match == NULL)
-			break;
-		if ((r = database_lookup(e, db, buf)) == -1) {
-			errx(1, "database_lookup failed for: %.*s\n",
-			    e->match_len, e->match);
-		} else {
-			printf("- %.*s", r, buf);
+	db_path = dict_path(name, ".dict.dz");
+	idx_path = dict_path(name, ".index");
+	db->name = name;
+	if ((r = database_open(db_path, db)) == -1 && errno == ENOENT) {
+		/* fall back to an uncompressed database */
+		free(db_path);
+		db_path = dict_path(name, ".dict");
+		r = database_open(db_path, db);
+	}
+	if (r == -1)
+		warnx("%s: database_open", name);
+	else if (index_open(idx_path, &db->index) == -1) {
+		warnx("%s: index_open", name);
+		r = -1;
+	}
+	if (r == 0 && cache)
+		database_cache(db, cache);
+	if (r == 0)
+		db->path = db_path;
+	else
+		free(db_path);
+	free(idx_path);
+
+	return r;
+}
+
+static void
+validate_database(struct dc_database *db, struct dc_pool *pool)
+{
+	off_t bad;
+
+	if (vcache_check(db) == 0)
+		return;
+	if (index_validate(&db->index, db->size, pool, &bad) == 0) {
+		vcache_store(db);
+		return;
+	}
+	if (bad == -1)
+		errx(1, "%s: index_validate: bad sidecar", db->name);
+	errx(1, "%s: index_validate: bad line at offset %lld", db->name,
+	    (long long)bad);
+}
+
+/*
+ * Inflate the whole database up front, or map the text saved by an
+ * earlier run, so that lookups only copy.
+ */
+static void
+load_database(struct dc_database *db, struct dc_pool *pool)
+{
+	const char *text;
+	size_t len;
+
+	if (!database_compressed(db) || vcache_text_load(db) == 0)
+		return;
+	if ((text = database_text(db, pool, &len)) == NULL)
+		err(1, "%s: database_text", db->name);
+	vcache_text_store(db, text, len);
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Open the n databases in names, or with no names every database below
+ * DICT_DIR sorted by name, skipping those that fail to open.
+ */
+static size_t
+open_databases(struct dc_database **dbsp, char **names, size_t n,
+    size_t cache)
+{
+	struct dc_database *dbs;
+	struct dirent *de;
+	DIR *dir;
+	size_t max = 0, i, ndbs = 0;
+	int all = n == 0;
+
+	if (all) {
+		if ((dir = opendir(DICT_DIR)) == NULL)
+			err(1, "%s", DICT_DIR);
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.' || de->d_type != DT_DIR)
+				continue;
+			if (n == max) {
+				max = MAXIMUM(16, max * 2);
+				if ((names = reallocarray(names, max,
+				    sizeof(*names))) == NULL)
+					err(1, "reallocarray");
+			}
+			if ((names[n++] = strdup(de->d_name)) == NULL)
+				err(1, "strdup");
+		}
+		closedir(dir);
+		qsort(names, n, sizeof(*names), name_cmp);
+	}
+
+	if ((dbs = calloc(MAXIMUM(n, 1), sizeof(*dbs))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		if (open_database(names[i], &dbs[ndbs], cache) == 0)
+			ndbs++;
+	if (all)
+		free(names);
+
+	*dbsp = dbs;
+	return ndbs;
+}
+
+/*
+ * Look up the word in one of the databases.  With more
+ * than one database the definitions are read here too, so they are
+ * inflated in parallel.
+ */
+static void
+fed_lookup(struct fed_job *job, struct fed_db *f)
+{
+	struct dc_index *idx = &f->f_db->index;
+	struct dc_index_entry *e;
+	size_t i = 0;
+	ssize_t r;
+
+	SLIST_INIT(&f->f_list);
+	if (job->nflag) {
+		f->f_n = index_prefix_count(job->word, idx);
+		return;
+	}
+	if (job->st != NULL) {
+		f->f_error = job->st->name;
+		r = job->st->find(job->word, idx, f->f_arena, &f->f_list);
+	} else if (job->eflag) {
+		f->f_error = "index_lev_find";
+		r = index_lev_find(job->word, idx, job->lev, job->pool,
+		    f->f_arena, &f->f_list);
+	} else {
+		f->f_error = "index_prefix_find";
+		r = index_prefix_find(job->word, idx, NULL, job->offset,
+		    job->limit, f->f_arena, &f->f_list);
+	}
+	if (r == -1) {
+		f->f_errno = errno;
+		return;
+	}
+	f->f_error = NULL;
+	f->f_n = r;
+	if (!job->prefetch || r == 0)
+		return;
+
+	f->f_error = "arena_alloc";
+	if ((f->f_defs = arena_alloc(f->f_arena, r * sizeof(*f->f_defs))) ==
+	    NULL) {
+		f->f_errno = errno;
+		return;
+	}
+	SLIST_FOREACH(e, &f->f_list, entries) {
+		f->f_defs[i].req = e;
+		if ((f->f_defs[i].out = arena_alloc(f->f_arena,
+		    e->def_len)) == NULL) {
+			f->f_errno = errno;
+			return;
+		}
+		if ((f->f_defs[i].len = database_lookup(e, f->f_db,
+		    f->f_defs[i].out)) == -1) {
+			f->f_error = "database_lookup";
+			f->f_errno = 0;
+			return;
 		}
+		i++;
 	}
+	f->f_error = NULL;
+}
+
+static void
+fed_work(void *arg, size_t start, size_t end, u_int worker)
+{
+	struct fed_job *job = arg;
+	size_t i;
+
+	for (i = start; i < end; i++)
+		fed_lookup(job, &job->f[i]);
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct dc_database mydb;
-	struct dc_index_list list;
-	struct dc_index_entry *myr;
-	char *db_path = NULL, *idx_path = NULL;
+	struct dc_database *dbs;
+	struct dc_arena *arena;
+	struct dc_server srv;
+	struct batch_word *words;
+	struct fed_job job;
+	struct fed_db *f;
+	const struct strategy *st = NULL;
+	struct dc_pool *pool = NULL;
+	char **names = NULL, *db_path, *idx_path;
 	char *lookup;
-	int ch, i;
-	int Vflag = 0, dflag = 0, mflag = 0;
+	char *laddr = "localhost", *lport = "2628", *upath = NULL;
+	const char *vdir;
+	FILE *fp = NULL;
+	const char *errstr;
+	u_int64_t hits, misses, h, m;
+	size_t cache = 0, ndbs, nnames = 0, maxnames = 0, nwords, total;
+	size_t offset = 0, limit = 0, clen = 0, j;
+	u_int threads = 1, lev = 0;
+	int ch, i, level = 6;
+	int Bflag = 0, Sflag = 0, Vflag = 0, dflag = 0, mflag = 0, nflag = 0;
+	int eflag = 0, vflag = 0, Mflag = 0;
+	struct dc_repack rp;
 
-	while ((ch = getopt(argc, argv, "D:Vdm")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "123456789BD:L:MR:SVc:de:f:j:l:mno:p:s:u:vz:")) != -1) {
 		switch (ch) {
+		case '1': case '2': case '3': case '4': case '5':
+		case '6': case '7': case '8': case '9':
+			level = ch - '0';
+			break;
+		case 'B':
+			Bflag = 1;
+			break;
 		case 'D':
-			asprintf(&db_path, "/usr/local/freedict/%s/%s.dict.dz",
-			    optarg, optarg);
-			asprintf(&idx_path, "/usr/local/freedict/%s/%s.index",
-			    optarg, optarg);
+			if (nnames == maxnames) {
+				maxnames = MAXIMUM(4, maxnames * 2);
+				if ((names = reallocarray(names, maxnames,
+				    sizeof(*names))) == NULL)
+					err(1, "reallocarray");
+			}
+			names[nnames++] = optarg;
+			break;
+		case 'L':
+			limit = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "limit is %s: %s", errstr, optarg);
+			break;
+		case 'M':
+			Mflag = 1;
+			break;
+		case 'R':
+			clen = strtonum(optarg, 1, UINT16_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "chunk length is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'S':
+			Sflag = 1;
 			break;
 		case 'V':
 			Vflag = 1;
 			break;
+		case 'c':
+			cache = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "cache size is %s: %s", errstr, optarg);
+			break;
 		case 'd':
 			dflag = 1;
 			break;
+		case 'e':
+			lev = strtonum(optarg, 0, LEV_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "distance is %s: %s", errstr, optarg);
+			eflag = 1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "-") == 0)
+				fp = stdin;
+			else if ((fp = fopen(optarg, "r")) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'j':
+			threads = strtonum(optarg, 1, THREADS_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "threads is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			laddr = optarg;
+			break;
 		case 'm':
 			mflag = 1;
 			break;
+		case 'n':
+			nflag = 1;
+			break;
+		case 'o':
+			offset = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "offset is %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			lport = optarg;
+			break;
+		case 's':
+			for (j = 0; st == NULL && j < NSTRATEGIES; j++)
+				if (strcmp(optarg, strategies[j].name) == 0)
+					st = &strategies[j];
+			if (st == NULL)
+				errx(1, "unknown strategy: %s", optarg);
+			break;
+		case 'u':
+			upath = optarg;
+			break;
+		case 'v':
+			vflag = 1;
+			break;
+		case 'z':
+			if (database_codec(optarg) == -1)
+				errx(1, "unknown codec: %s", optarg);
+			break;
 		default:
 			usage();
 		}
@@ -112,42 +612,212 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1 || db_path == NULL || idx_path == NULL)
+	if (clen != 0) {
+		if (argc != 0 || fp != NULL || Bflag || Sflag || nflag)
+			usage();
+	} else if (Sflag) {
+		if (argc != 0 || fp != NULL || Bflag || nflag)
+			usage();
+	} else if (nnames == 0)
+		usage();
+	else if (Bflag ? argc != 0 || fp != NULL : argc != (fp == NULL))
+		usage();
+	else if (nflag && (Bflag || fp != NULL))
+		usage();
+	else if ((eflag || st != NULL) && (Bflag || fp != NULL || nflag))
+		usage();
+	else if (eflag && st != NULL)
 		usage();
 
 	if (!dflag)
 		mflag = 1;
+	/* "*" is every database, like in DICT */
+	for (j = 0; j < nnames; j++)
+		if (strcmp(names[j], "*") == 0)
+			nnames = 0;
 
-	if (unveil("/usr/local/freedict", "r") == -1)
+	if (!Vflag && (vdir = vcache_init()) != NULL &&
+	    unveil(vdir, "rwc") == -1)
 		err(1, "unveil");
-	if (pledge("stdio rpath", NULL) == -1)
+
+	if (clen != 0) {
+		if (unveil(DICT_DIR, "rwc") == -1)
+			err(1, "unveil");
+		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+			err(1, "pledge");
+		ndbs = open_databases(&dbs, names, nnames, 0);
+		if (nnames != 0 && ndbs != nnames)
+			return 1;
+		if ((pool = pool_create(threads)) == NULL)
+			err(1, "pool_create");
+		for (j = 0; j < ndbs; j++) {
+			db_path = dict_path(dbs[j].name, ".dict.dz");
+			if (repack(&dbs[j], db_path, clen, level, pool,
+			    &rp) == -1)
+				err(1, "%s: repack", dbs[j].name);
+			printf("%s: %zu bytes in %zu chunks of %zu, level %d\n",
+			    dbs[j].name, rp.r_text, rp.r_chunks, clen, level);
+			printf("  size %lld -> %lld bytes, %.1f%% of the text\n",
+			    (long long)dbs[j].ident.size,
+			    (long long)rp.r_size, rp.r_text == 0 ? 0.0 :
+			    100.0 * rp.r_size / rp.r_text);
+			printf("  %d byte reads %.1f -> %.1f us\n",
+			    REPACK_READ, rp.r_usec_old, rp.r_usec_new);
+			/*
+			 * An uncompressed database is left in place, the
+			 * .dict.dz next to it is opened from now on.
+			 */
+			if (strcmp(dbs[j].path, db_path) != 0)
+				printf("  %s kept, no longer read\n",
+				    dbs[j].path);
+			free(db_path);
+		}
+		return 0;
+	}
+
+	if (Bflag) {
+		if (unveil(DICT_DIR, "rwc") == -1)
+			err(1, "unveil");
+		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+			err(1, "pledge");
+		ndbs = open_databases(&dbs, names, nnames, 0);
+		if (nnames != 0 && ndbs != nnames)
+			return 1;
+		if ((pool = pool_create(threads)) == NULL)
+			err(1, "pool_create");
+		for (j = 0; j < ndbs; j++) {
+			validate_database(&dbs[j], pool);
+			idx_path = dict_path(dbs[j].name, ".index");
+			if (index_build(idx_path, &dbs[j].index) == -1)
+				err(1, "%s: index_build", dbs[j].name);
+			free(idx_path);
+		}
+		return 0;
+	}
+
+	if (unveil(DICT_DIR, "r") == -1)
+		err(1, "unveil");
+	if (Sflag) {
+		if (upath != NULL && unveil(upath, "rwc") == -1)
+			err(1, "unveil");
+		if (pledge("stdio rpath wpath cpath inet unix dns",
+		    NULL) == -1)
+			err(1, "pledge");
+	} else if (pledge("stdio rpath wpath cpath", NULL) == -1)
 		err(1, "pledge");
 
-	SLIST_INIT(&list);
-	if ((myr = calloc(MAX_RESULTS, sizeof(struct dc_index_entry))) == NULL)
-		err(1, "calloc");
-	for (i = 0; i < MAX_RESULTS; i++)
-		SLIST_INSERT_HEAD(&list, &myr[i], entries);
+	if ((arena = arena_create()) == NULL)
+		err(1, "arena_create");
+
+	ndbs = open_databases(&dbs, names, nnames, cache);
+	if (nnames != 0 && ndbs != nnames)
+		return 1;
 
-	if (database_open(db_path, &mydb) == -1)
-		errx(1, "database_open");
-	if (index_open(idx_path, &mydb.index) == -1)
-		errx(1, "index_open");
+	if ((pool = pool_create(threads)) == NULL)
+		err(1, "pool_create");
 
-	if (pledge("stdio", NULL) == -1)
+	if (Sflag) {
+		memset(&srv, 0, sizeof(srv));
+		srv.dbs = dbs;
+		srv.ndbs = ndbs;
+		srv.arena = arena;
+		srv.pool = pool;
+		srv.lev_max = eflag ? lev : 1;
+		if (laddr[0] != '\0' && server_listen(&srv, laddr, lport) == -1)
+			errx(1, "cannot listen on %s port %s", laddr, lport);
+		if (upath != NULL && server_listen_unix(&srv, upath) == -1)
+			err(1, "%s", upath);
+	}
+
+	for (j = 0; j < ndbs && !Vflag; j++)
+		validate_database(&dbs[j], pool);
+	for (j = 0; j < ndbs && Mflag; j++)
+		load_database(&dbs[j], pool);
+
+	if (pledge(Sflag ? "stdio inet unix" : "stdio", NULL) == -1)
 		err(1, "pledge");
 
-	if (!Vflag && index_validate(&mydb.index, mydb.size) == -1)
-		errx(1, "index_validate");
+	if (Sflag)
+		server_loop(&srv);
+
+	if (fp != NULL) {
+		words = batch_read(fp, &nwords);
+		for (j = 0; j < ndbs; j++) {
+			if (ndbs > 1)
+				printf("From %s:\n", dbs[j].name);
+			batch(words, nwords, &dbs[j], arena, pool, offset,
+			    limit, mflag, dflag);
+		}
+		goto done;
+	}
+
 	if ((lookup = strdup(argv[0])) == NULL)
 		errx(1, "strdup");
 	for (i = 0; lookup[i] != '\0'; i++)
 		lookup[i] = tolower(lookup[i]);
-	if (index_prefix_find(lookup, &mydb.index, &list) == -1)
-		errx(1, "index_prefix_find");
 
-	if (mflag)
-		match(&list);
-	if (dflag)
-		define(&mydb, &list);
+	memset(&job, 0, sizeof(job));
+	job.word = lookup;
+	job.st = st;
+	job.offset = offset;
+	job.limit = limit;
+	job.lev = lev;
+	job.eflag = eflag;
+	job.nflag = nflag;
+	job.prefetch = dflag && ndbs > 1;
+	if ((job.f = calloc(MAXIMUM(ndbs, 1), sizeof(*job.f))) == NULL)
+		err(1, "calloc");
+	for (j = 0; j < ndbs; j++) {
+		job.f[j].f_db = &dbs[j];
+		if (j == 0)
+			job.f[j].f_arena = arena;
+		else if ((job.f[j].f_arena = arena_create()) == NULL)
+			err(1, "arena_create");
+	}
+	if (ndbs == 1) {
+		job.pool = pool;
+		fed_lookup(&job, &job.f[0]);
+	} else
+		pool_run(pool, fed_work, &job, ndbs);
+
+	for (total = 0, j = 0; j < ndbs; j++) {
+		f = &job.f[j];
+		if (f->f_error != NULL) {
+			if ((errno = f->f_errno) == 0)
+				errx(1, "%s: %s failed", f->f_db->name,
+				    f->f_error);
+			err(1, "%s: %s", f->f_db->name, f->f_error);
+		}
+		total += f->f_n;
+		if (f->f_n == 0 && !nflag)
+			continue;
+		if (ndbs > 1)
+			printf("From %s:\n", f->f_db->name);
+		if (nflag) {
+			printf("%zu\n", f->f_n);
+			continue;
+		}
+		if (mflag)
+			match(&f->f_list);
+		if (dflag && f->f_defs == NULL)
+			define(f->f_db, &f->f_list, pool);
+		for (i = 0; dflag && f->f_defs != NULL && (size_t)i < f->f_n;
+		    i++) {
+			fputs("- ", stdout);
+			fwrite(f->f_defs[i].out, 1, f->f_defs[i].len, stdout);
+		}
+	}
+	if (total == 0 && !nflag && st == NULL && !eflag)
+		errx(1, "%s: no match", argv[0]);
+
+ done:
+	if (vflag) {
+		for (hits = misses = 0, j = 0; j < ndbs; j++) {
+			database_stats(&dbs[j], &h, &m);
+			hits += h;
+			misses += m;
+		}
+		fprintf(stderr, "cache: %llu hits, %llu misses\n",
+		    (unsigned long long)hits, (unsigned long long)misses);
+	}
 }
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A fixed set of worker threads running one parallel loop at a time.
+ * pool_run() hands out contiguous blocks of [0, n) so neighbouring items,
+ * e.g. definitions sorted by offset, stay on one worker.  The calling
+ * thread works along as worker 0.
+ */
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "dict.h"
+#include "pool.h"
+
+#define POOL_BLOCKS	4	/* blocks per worker, for balance */
+
+struct dc_pool {
+	pthread_mutex_t	 p_mtx;
+	pthread_cond_t	 p_work;	/* a new loop was posted */
+	pthread_cond_t	 p_done;	/* the last worker left the loop */
+	pthread_t	*p_threads;
+	u_int		 p_nthreads;	/* including the caller */
+	dc_pool_fn	 p_fn;
+	void		*p_arg;
+	size_t		 p_n;
+	size_t		 p_next;
+	size_t		 p_grain;
+	u_int		 p_busy;
+	u_int64_t	 p_gen;
+	int		 p_quit;
+};
+
+struct pool_worker {
+	struct dc_pool	*w_pool;
+	u_int		 w_id;
+};
+
+static void
+pool_work(struct dc_pool *p, u_int id)
+{
+	size_t start, end;
+
+	for (;;) {
+		pthread_mutex_lock(&p->p_mtx);
+		start = p->p_next;
+		end = MINIMUM(p->p_n, start + p->p_grain);
+		p->p_next = end;
+		pthread_mutex_unlock(&p->p_mtx);
+		if (start >= end)
+			return;
+		p->p_fn(p->p_arg, start, end, id);
+	}
+}
+
+static void *
+pool_thread(void *arg)
+{
+	struct pool_worker *w = arg;
+	struct dc_pool *p = w->w_pool;
+	u_int id = w->w_id;
+	u_int64_t seen = 0;
+
+	free(w);
+	pthread_mutex_lock(&p->p_mtx);
+	for (;;) {
+		while (p->p_gen == seen && !p->p_quit)
+			pthread_cond_wait(&p->p_work, &p->p_mtx);
+		if (p->p_quit)
+			break;
+		seen = p->p_gen;
+		pthread_mutex_unlock(&p->p_mtx);
+
+		pool_work(p, id);
+
+		pthread_mutex_lock(&p->p_mtx);
+		if (--p->p_busy == 0)
+			pthread_cond_signal(&p->p_done);
+	}
+	pthread_mutex_unlock(&p->p_mtx);
+
+	return NULL;
+}
+
+struct dc_pool *
+pool_create(u_int nthreads)
+{
+	struct dc_pool *p;
+	struct pool_worker *w;
+	u_int i;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+	p->p_nthreads = MAXIMUM(nthreads, 1);
+	if ((p->p_threads = calloc(p->p_nthreads, sizeof(pthread_t))) == NULL)
+		goto fail;
+	if (pthread_mutex_init(&p->p_mtx, NULL) != 0 ||
+	    pthread_cond_init(&p->p_work, NULL) != 0 ||
+	    pthread_cond_init(&p->p_done, NULL) != 0)
+		goto fail;
+
+	for (i = 1; i < p->p_nthreads; i++) {
+		if ((w = malloc(sizeof(*w))) == NULL)
+			break;
+		w->w_pool = p;
+		w->w_id = i;
+		if (pthread_create(&p->p_threads[i], NULL, pool_thread,
+		    w) != 0) {
+			free(w);
+			break;
+		}
+	}
+	/* run with the threads we got */
+	p->p_nthreads = i;
+
+	return p;
+
+ fail:
+	free(p->p_threads);
+	free(p);
+	return NULL;
+}
+
+u_int
+pool_size(const struct dc_pool *p)
+{
+	return p->p_nthreads;
+}
+
+/*
+ * Call fn(arg, start, end, worker) until [0, n) is covered and wait for
+ * all workers to return.  Worker numbers are below pool_size().  A pool
+ * runs one loop at a time, fn must not call pool_run() on the same pool.
+ */
+void
+pool_run(struct dc_pool *p, dc_pool_fn fn, void *arg, size_t n)
+{
+	if (n == 0)
+		return;
+	if (p->p_nthreads == 1) {
+		fn(arg, 0, n, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&p->p_mtx);
+	p->p_fn = fn;
+	p->p_arg = arg;
+	p->p_n = n;
+	p->p_next = 0;
+	p->p_grain = MAXIMUM(1, n / (p->p_nthreads * POOL_BLOCKS));
+	p->p_busy = p->p_nthreads - 1;
+	p->p_gen++;
+	pthread_cond_broadcast(&p->p_work);
+	pthread_mutex_unlock(&p->p_mtx);
+
+	pool_work(p, 0);
+
+	pthread_mutex_lock(&p->p_mtx);
+	while (p->p_busy != 0)
+		pthread_cond_wait(&p->p_done, &p->p_mtx);
+	pthread_mutex_unlock(&p->p_mtx);
+}
+
+void
+pool_destroy(struct dc_pool *p)
+{
+	u_int i;
+
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->p_mtx);
+	p->p_quit = 1;
+	pthread_cond_broadcast(&p->p_work);
+	pthread_mutex_unlock(&p->p_mtx);
+	for (i = 1; i < p->p_nthreads; i++)
+		pthread_join(p->p_threads[i], NULL);
+
+	pthread_mutex_destroy(&p->p_mtx);
+	pthread_cond_destroy(&p->p_work);
+	pthread_cond_destroy(&p->p_done);
+	free(p->p_threads);
+	free(p);
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Look words up with index_bound() bisecting the text index and the
+ * .bin records, and with index_eyt_bound() walking the .eyt tree,
+ * require the same ranges and print the time per lookup of each.
+ * Without an argument a generated index of a million lines is used,
+ * otherwise the given .index with its sidecars.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "index.c"
+
+#define NWORDS		1000000		/* in the generated index */
+#define NLOOKUPS	1000000
+
+static int	 failed;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+word_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Write a sorted index of random words to path.
+ */
+static void
+make_index(const char *path)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char **w;
+	FILE *fp;
+	size_t i, j, len;
+
+	if ((w = calloc(NWORDS, sizeof(*w))) == NULL)
+		err(1, NULL);
+	srandom(1);
+	for (i = 0; i < NWORDS; i++) {
+		/* short words repeat, so some ranges hold several lines */
+		len = 3 + random() % 10;
+		if ((w[i] = malloc(len + 1)) == NULL)
+			err(1, NULL);
+		for (j = 0; j < len; j++)
+			w[i][j] = 'a' + random() % 26;
+		w[i][len] = '\0';
+	}
+	qsort(w, NWORDS, sizeof(*w), word_cmp);
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	for (i = 0; i < NWORDS; i++) {
+		fprintf(fp, "%s\t%c%c%c\t%c\n", w[i], b64[i >> 12 & 63],
+		    b64[i >> 6 & 63], b64[i & 63], b64[1 + i % 63]);
+		free(w[i]);
+	}
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+	free(w);
+}
+
+/*
+ * Pick n lookups from the headwords, every third one changed so it
+ * falls between two of them.
+ */
+static char **
+make_lookups(const struct dc_index *idx, size_t n)
+{
+	const char *p, *end = idx->data + idx->size;
+	char **w;
+	size_t i, len;
+
+	if ((w = calloc(n, sizeof(*w))) == NULL)
+		err(1, NULL);
+	srandom(2);
+	for (i = 0; i < n; i++) {
+		p = idx->data + random() % idx->size;
+		while (p > idx->data && p[-1] != '\n')
+			p--;
+		for (len = 0; p + len < end && p[len] != '\t'; len++)
+			;
+		if ((w[i] = malloc(len + 2)) == NULL)
+			err(1, NULL);
+		memcpy(w[i], p, len);
+		w[i][len] = '\0';
+		if (i % 3 == 2)
+			strlcat(w[i], "q", len + 2);
+	}
+	return w;
+}
+
+/*
+ * The layouts a lookup can bisect, from the text index up.  The hash
+ * table is hidden throughout, exact matches would use it otherwise.
+ */
+static const struct {
+	const char	*name;
+	int		 recs;		/* bisect the .bin records */
+	int		 eyt;		/* walk the .eyt tree */
+} layouts[] = {
+	{ "text",	0, 0 },
+	{ "records",	1, 0 },
+	{ "eytzinger",	1, 1 },
+};
+#define NLAYOUTS	(sizeof(layouts) / sizeof(layouts[0]))
+
+/*
+ * Time the lookups, then turn each range into the offsets of its first
+ * and last headword, which do not depend on the layout.
+ */
+static double
+run(char **w, size_t n, const struct dc_index *idx,
+    int (*cursor)(const char *, const struct dc_index *, struct dc_cursor *),
+    off_t *ranges)
+{
+	struct dc_cursor c;
+	double t;
+	off_t p;
+	size_t i;
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		if (cursor(w[i], idx, &c) == -1)
+			c.c_pos = c.c_end = 0;
+		ranges[2 * i] = c.c_pos;
+		ranges[2 * i + 1] = c.c_end;
+	}
+	t = (now() - t) / n * 1e9;
+
+	for (i = 0; i < n; i++) {
+		if (ranges[2 * i] == ranges[2 * i + 1]) {
+			ranges[2 * i] = ranges[2 * i + 1] = -1;
+		} else if (idx->recs != NULL) {
+			ranges[2 * i] = idx->recs[ranges[2 * i]].r_word;
+			ranges[2 * i + 1] =
+			    idx->recs[ranges[2 * i + 1] - 1].r_word;
+		} else {
+			p = ranges[2 * i + 1] - 1;
+			while (p > 0 && idx->data[p - 1] != '\n')
+				p--;
+			ranges[2 * i + 1] = p;
+		}
+	}
+	return t;
+}
+
+static void
+compare(const char *what, char **w, size_t n, struct dc_index *idx,
+    int (*cursor)(const char *, const struct dc_index *, struct dc_cursor *))
+{
+	const struct dc_index_rec *recs = idx->recs;
+	const struct dc_index_ph *ph = idx->ph;
+	const u_int64_t *eyt = idx->eyt;
+	off_t *ranges[NLAYOUTS];
+	double t[NLAYOUTS];
+	size_t i, l;
+
+	idx->ph = NULL;
+	for (l = 0; l < NLAYOUTS; l++) {
+		if ((ranges[l] = reallocarray(NULL, n,
+		    2 * sizeof(*ranges[l]))) == NULL)
+			err(1, NULL);
+		idx->recs = layouts[l].recs ? recs : NULL;
+		idx->eyt = layouts[l].eyt ? eyt : NULL;
+		t[l] = run(w, n, idx, cursor, ranges[l]);
+	}
+	idx->recs = recs;
+	idx->ph = ph;
+	idx->eyt = eyt;
+
+	for (l = 1; l < NLAYOUTS; l++) {
+		for (i = 0; i < n; i++) {
+			if (ranges[0][2 * i] == ranges[l][2 * i] &&
+			    ranges[0][2 * i + 1] == ranges[l][2 * i + 1])
+				continue;
+			warnx("%s \"%s\": %s headwords at %lld to %lld, "
+			    "%s at %lld to %lld", what, w[i],
+			    layouts[0].name, (long long)ranges[0][2 * i],
+			    (long long)ranges[0][2 * i + 1], layouts[l].name,
+			    (long long)ranges[l][2 * i],
+			    (long long)ranges[l][2 * i + 1]);
+			failed = 1;
+			break;
+		}
+	}
+
+	printf("%s:", what);
+	for (l = 0; l < NLAYOUTS; l++)
+		printf("%s %s %.0f ns", l == 0 ? "" : ",", layouts[l].name,
+		    t[l]);
+	printf(" per lookup\n");
+	for (l = 0; l < NLAYOUTS; l++)
+		free(ranges[l]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct dc_index idx;
+	char **w, *path = "bound.index";
+	size_t i;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: bound_bench [index]\n");
+		return 1;
+	}
+	if (argc == 2)
+		path = argv[1];
+	else {
+		make_index(path);
+		if (index_open(path, &idx) == -1)
+			err(1, "%s", path);
+		if (index_build(path, &idx) == -1)
+			err(1, "%s: index_build", path);
+	}
+	if (index_open(path, &idx) == -1)
+		err(1, "%s", path);
+	if (idx.eyt == NULL || idx.recs == NULL || idx.neyt != idx.nrecs)
+		errx(1, "%s: no .eyt sidecar, run dict -B", path);
+
+	w = make_lookups(&idx, NLOOKUPS);
+	compare("exact", w, NLOOKUPS, &idx, index_exact_cursor);
+	compare("prefix", w, NLOOKUPS, &idx, index_prefix_cursor);
+
+	for (i = 0; i < NLOOKUPS; i++)
+		free(w[i]);
+	free(w);
+	return failed;
+}
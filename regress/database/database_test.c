@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Write dictzip files whose chunks inflate to the chunk length, short
+ * of it or past it, all of them valid gzip, and read every chunk with
+ * each codec.  A chunk of the wrong length has to fail with EFTYPE,
+ * the text after it would otherwise be read from the wrong offset.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "dict.h"
+#include "database.h"
+
+#define CLEN	4000		/* chunk length in the header */
+#define NCHUNKS	3
+#define READ	100
+
+static int	 failed;
+
+/*
+ * Write path with NCHUNKS chunks of the given inflated lengths, the
+ * text being the offset of each line.
+ */
+static char *
+make_dict(const char *path, const size_t *lens)
+{
+	u_char hdr[12 + 10 + 2 * NCHUNKS], *out[NCHUNKS], trailer[8];
+	size_t outlen[NCHUNKS], total = 0, i, j;
+	z_stream z;
+	uLong crc;
+	char *text;
+	FILE *fp;
+
+	for (i = 0; i < NCHUNKS; i++)
+		total += lens[i];
+	if ((text = malloc(total)) == NULL)
+		err(1, NULL);
+	for (i = 0; i < total; i++)
+		text[i] = i % 10 == 9 ? '\n' : 'a' + i / 10 % 26;
+	crc = crc32(crc32(0, NULL, 0), (u_char *)text, total);
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 9, Z_DEFLATED, -MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		errx(1, "deflateInit2");
+	for (i = 0, j = 0; i < NCHUNKS; j += lens[i++]) {
+		outlen[i] = deflateBound(&z, lens[i]) + 16;
+		if ((out[i] = malloc(outlen[i])) == NULL)
+			err(1, NULL);
+		z.next_in = (u_char *)text + j;
+		z.avail_in = lens[i];
+		z.next_out = out[i];
+		z.avail_out = outlen[i];
+		if (deflate(&z, i == NCHUNKS - 1 ? Z_FINISH :
+		    Z_FULL_FLUSH) == Z_STREAM_ERROR)
+			errx(1, "deflate");
+		outlen[i] -= z.avail_out;
+	}
+	deflateEnd(&z);
+
+	/* gzip header with FEXTRA, holding the RA subfield */
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = 0x1f;
+	hdr[1] = 0x8b;
+	hdr[2] = 8;
+	hdr[3] = 4;
+	hdr[9] = 3;
+	hdr[10] = 10 + 2 * NCHUNKS;
+	hdr[12] = 'R';
+	hdr[13] = 'A';
+	hdr[14] = 6 + 2 * NCHUNKS;
+	hdr[16] = 1;
+	hdr[18] = CLEN & 0xff;
+	hdr[19] = CLEN >> 8;
+	hdr[20] = NCHUNKS;
+	for (i = 0; i < NCHUNKS; i++) {
+		hdr[22 + 2 * i] = outlen[i] & 0xff;
+		hdr[23 + 2 * i] = outlen[i] >> 8;
+	}
+	for (i = 0; i < 4; i++) {
+		trailer[i] = crc >> (8 * i);
+		trailer[4 + i] = total >> (8 * i);
+	}
+
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	fwrite(hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < NCHUNKS; i++) {
+		fwrite(out[i], outlen[i], 1, fp);
+		free(out[i]);
+	}
+	fwrite(trailer, sizeof(trailer), 1, fp);
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+
+	return text;
+}
+
+/*
+ * Read the start of every chunk, bad is the first chunk of the wrong
+ * length or NCHUNKS if there is none.
+ */
+static void
+check(const char *what, const size_t *lens, size_t bad)
+{
+	static const char *codecs[] = { "inflate", "inflateback" };
+	struct dc_database db;
+	struct dc_index_entry e;
+	char buf[READ], *text, path[64];
+	size_t c, k;
+	ssize_t r;
+
+	(void)snprintf(path, sizeof(path), "%s.dict.dz", what);
+	text = make_dict(path, lens);
+
+	for (k = 0; k < sizeof(codecs) / sizeof(codecs[0]); k++) {
+		if (database_codec(codecs[k]) == -1)
+			errx(1, "%s: unknown codec", codecs[k]);
+		if (database_open(path, &db) == -1)
+			err(1, "%s", path);
+		for (c = 0; c < NCHUNKS; c++) {
+			e.def_off = c * CLEN;
+			e.def_len = READ;
+			errno = 0;
+			r = database_lookup(&e, &db, buf);
+			if (c < bad && (r == -1 ||
+			    memcmp(buf, text + e.def_off, READ) != 0)) {
+				warnx("%s, %s: chunk %zu misread", what,
+				    codecs[k], c);
+				failed = 1;
+			} else if (c == bad && (r != -1 || errno != EFTYPE)) {
+				warnx("%s, %s: chunk %zu read, error %d",
+				    what, codecs[k], c, errno);
+				failed = 1;
+			}
+		}
+		database_close(&db);
+	}
+	free(text);
+}
+
+int
+main(void)
+{
+	static const size_t whole[] = { CLEN, CLEN, 1000 };
+	static const size_t shortmid[] = { CLEN, 3000, 1000 };
+	static const size_t longmid[] = { CLEN, 5000, 1000 };
+	static const size_t longlast[] = { CLEN, CLEN, CLEN + 1 };
+
+	check("whole", whole, NCHUNKS);
+	check("short", shortmid, 1);
+	check("long", longmid, 1);
+	/* the trailer says the last chunk runs past the chunk length */
+	check("longlast", longlast, 2);
+
+	return failed;
+}
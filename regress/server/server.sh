@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Run a server on a temporary socket and print a session with it, the
+# greeting's message id stripped.  usage: server.sh dict socket
+
+set -e
+
+dict=$1
+sock=$2
+
+rm -f $sock
+$dict -S -V -l "" -u $sock &
+pid=$!
+trap 'kill $pid 2>/dev/null' EXIT
+
+i=0
+while [ ! -S $sock ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "server did not start" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+printf '%s\r\n' \
+	'DEFINE * apple' \
+	'DEFINE ! apple' \
+	'DEFINE two banana' \
+	'DEFINE nosuch apple' \
+	'MATCH * prefix ap' \
+	'MATCH ! exact apple' \
+	'MATCH ! exact cherry' \
+	'MATCH * nosuch apple' \
+	'SHOW DB' \
+	'SHOW STRAT' \
+	'QUIT' |
+    nc -U $sock | tr -d '\r' | sed 's/^220 dict <> <.*>$/220 dict <> <>/'
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Run the vector validators and validate_scalar() on a clean index and
+ * on copies of it broken at every byte, and require the same offset
+ * and the same state afterwards.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "validate.c"
+
+#define NLINES	97		/* lines of differing length */
+
+typedef off_t (*validate_fn)(const char *, off_t, struct dc_validate *);
+
+static const struct {
+	const char	*name;
+	validate_fn	 fn;
+} impls[] = {
+	{ "text",	validate_text },
+#ifdef VALIDATE_X86
+	{ "sse2",	validate_sse2 },
+	{ "avx2",	validate_avx2 },
+#endif
+};
+#define NIMPLS	(sizeof(impls) / sizeof(impls[0]))
+
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int failed;
+
+/* the state index_validate() starts from */
+static void
+validate_init(struct dc_validate *v, int max)
+{
+	memset(v, 0, sizeof(*v));
+	v->v_off_max = v->v_len_max = max;
+	v->v_b64chars = -1;
+}
+
+static char *
+make_index(size_t *len)
+{
+	char *buf, *p;
+	size_t i, j;
+
+	if ((buf = malloc(NLINES * 64)) == NULL)
+		err(1, NULL);
+	for (p = buf, i = 0; i < NLINES; i++) {
+		for (j = 0; j < 1 + i % 13; j++)
+			*p++ = 'a' + (i + j) % 26;
+		*p++ = '\t';
+		for (j = 0; j < 1 + i % 5; j++)
+			*p++ = b64[(i * 7 + j) % 64];
+		*p++ = '\t';
+		for (j = 0; j < 1 + i % 3; j++)
+			*p++ = b64[(i * 11 + j) % 64];
+		*p++ = '\n';
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static int
+supported(size_t k)
+{
+#ifdef VALIDATE_X86
+	if (impls[k].fn == validate_avx2) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return 1;
+}
+
+/*
+ * Every implementation has to agree with the scalar loop on data.
+ */
+static void
+check(const char *what, size_t pos, const char *data, size_t len,
+    int max)
+{
+	struct dc_validate v, want;
+	off_t r, wr;
+	size_t k;
+
+	validate_init(&want, max);
+	wr = validate_scalar(data, len, &want);
+	for (k = 0; k < NIMPLS; k++) {
+		if (!supported(k))
+			continue;
+		validate_init(&v, max);
+		r = impls[k].fn(data, len, &v);
+		if (r != wr || (r == -1 && memcmp(&v, &want,
+		    sizeof(v)) != 0)) {
+			warnx("%s at %zu, length %zu: %s says %lld, "
+			    "scalar %lld", what, pos, len, impls[k].name,
+			    (long long)r, (long long)wr);
+			failed = 1;
+		}
+	}
+}
+
+int
+main(void)
+{
+	static const struct {
+		const char	*what;
+		char		 c;
+	} bad[] = {
+		{ "bad base64 byte",	'!' },
+		{ "NUL",		'\0' },
+		{ "high byte",		'\xe9' },
+		{ "stray tab",		'\t' },
+		{ "stray newline",	'\n' },
+	};
+	struct dc_validate v;
+	char *clean, *data;
+	size_t len, n, i, k;
+	int max;
+
+	clean = make_index(&len);
+	if ((data = malloc(len)) == NULL)
+		err(1, NULL);
+
+	validate_init(&v, 8);
+	if (validate_scalar(clean, len, &v) != -1)
+		errx(1, "clean index rejected");
+
+	/* the clean index, cut so the tail takes every length */
+	for (n = len - 40; n <= len; n++)
+		check("clean", n, clean, n, 8);
+
+	for (max = 3; max <= 8; max += 5) {
+		for (i = 0; i < len; i++) {
+			for (k = 0; k < sizeof(bad) / sizeof(bad[0]); k++) {
+				memcpy(data, clean, len);
+				data[i] = bad[k].c;
+				check(bad[k].what, i, data, len, max);
+			}
+			/* a missing tab joins two fields */
+			if (clean[i] == '\t') {
+				memcpy(data, clean, len);
+				data[i] = 'A';
+				check("missing tab", i, data, len, max);
+			}
+		}
+	}
+
+	/* in the tail, after the last whole block */
+	for (i = len - 31; i < len; i++) {
+		memcpy(data, clean, len);
+		data[i] = '\0';
+		check("NUL in the tail", i, data, len, 8);
+	}
+
+	free(data);
+	free(clean);
+	return failed;
+}
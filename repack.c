@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Rewrite a database as dictzip with a chosen chunk length and level.
+ * Every chunk is deflated on its own by a fresh stream and ends in a
+ * full flush, the last one of a member in the final block, so the
+ * chunks compress in parallel and still join into one deflate stream.
+ * A member holds as many chunks as its 16 bit extra field can list.
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "dict.h"
+#include "database.h"
+#include "pool.h"
+#include "repack.h"
+
+#define REPACK_XLEN	(4 + 6)		/* RA subfield, without the sizes */
+#define REPACK_MEMBER	((UINT16_MAX - REPACK_XLEN) / 2)	/* chunks */
+#define REPACK_SAMPLES	1000		/* reads timed */
+
+struct repack_job {
+	const char	*text;
+	size_t		 len;
+	size_t		 clen;
+	size_t		 nchunks;
+	size_t		 bound;		/* of a deflated chunk */
+	z_stream	*streams;	/* one per worker */
+	u_char		*out;		/* bound bytes per chunk */
+	size_t		*sizes;		/* deflated, or 0 */
+	u_long		*crcs;
+};
+
+static void
+repack_work(void *arg, size_t start, size_t end, u_int worker)
+{
+	struct repack_job *job = arg;
+	z_stream *z = &job->streams[worker];
+	size_t i, off, n;
+	int last, error;
+
+	for (i = start; i < end; i++) {
+		off = i * job->clen;
+		n = MINIMUM(job->clen, job->len - off);
+		last = i == job->nchunks - 1 || i % REPACK_MEMBER ==
+		    REPACK_MEMBER - 1;
+		job->crcs[i] = crc32(0L, (const Bytef *)job->text + off, n);
+		if (deflateReset(z) != Z_OK)
+			continue;
+		z->next_in = (Bytef *)job->text + off;
+		z->avail_in = n;
+		z->next_out = job->out + i * job->bound;
+		z->avail_out = job->bound;
+		error = deflate(z, last ? Z_FINISH : Z_FULL_FLUSH);
+		if (error != (last ? Z_STREAM_END : Z_OK) || z->avail_in != 0)
+			continue;
+		job->sizes[i] = job->bound - z->avail_out;
+	}
+}
+
+static void
+put16(u_char *p, u_int v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void
+put32(u_char *p, u_int32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+/*
+ * Write the member holding the n chunks from first: the gzip header
+ * with its RA table, the chunks and the trailer.
+ */
+static int
+repack_member(FILE *fp, const struct repack_job *job, int level,
+    size_t first, size_t n)
+{
+	u_char *h, trailer[8];
+	size_t hlen, i, len, mlen = 0;
+	u_long crc = crc32(0L, Z_NULL, 0);
+	int ret = -1;
+
+	hlen = 12 + REPACK_XLEN + 2 * n;
+	if ((h = calloc(1, hlen)) == NULL)
+		return -1;
+	h[0] = 0x1f;
+	h[1] = 0x8b;
+	h[2] = Z_DEFLATED;
+	h[3] = 0x04;			/* extra field */
+	h[8] = level == 9 ? 2 : level == 1 ? 4 : 0;
+	h[9] = 3;			/* unix */
+	put16(h + 10, REPACK_XLEN + 2 * n);
+	h[12] = 'R';
+	h[13] = 'A';
+	put16(h + 14, 6 + 2 * n);
+	put16(h + 16, 1);
+	put16(h + 18, job->clen);
+	put16(h + 20, n);
+	for (i = 0; i < n; i++) {
+		put16(h + 22 + 2 * i, job->sizes[first + i]);
+		len = MINIMUM(job->clen, job->len - (first + i) * job->clen);
+		crc = crc32_combine(crc, job->crcs[first + i], len);
+		mlen += len;
+	}
+	put32(trailer, crc);
+	put32(trailer + 4, mlen & 0xffffffff);
+
+	if (fwrite(h, hlen, 1, fp) != 1)
+		goto done;
+	for (i = first; i < first + n; i++)
+		if (fwrite(job->out + i * job->bound, job->sizes[i], 1,
+		    fp) != 1)
+			goto done;
+	if (fwrite(trailer, sizeof(trailer), 1, fp) != 1)
+		goto done;
+	ret = 0;
+ done:
+	free(h);
+	return ret;
+}
+
+/*
+ * Write the members to a temporary file next to path, and move it over
+ * path.
+ */
+static int
+repack_write(const char *path, const struct repack_job *job, int level,
+    off_t *size)
+{
+	FILE *fp = NULL;
+	char *tpath = NULL;
+	size_t i;
+	int fd, ret = -1;
+
+	if (asprintf(&tpath, "%s.XXXXXXXXXX", path) == -1)
+		return -1;
+	if ((fd = mkstemp(tpath)) == -1)
+		goto done;
+	if (fchmod(fd, 0444) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tpath);
+		goto done;
+	}
+	for (i = 0; i < job->nchunks; i += REPACK_MEMBER)
+		if (repack_member(fp, job, level, i,
+		    MINIMUM(REPACK_MEMBER, job->nchunks - i)) == -1)
+			goto fail;
+	*size = ftello(fp);
+	if (fclose(fp) == EOF) {
+		fp = NULL;
+		goto fail;
+	}
+	fp = NULL;
+	if (rename(tpath, path) == -1)
+		goto fail;
+	ret = 0;
+	goto done;
+
+ fail:
+	if (fp != NULL)
+		fclose(fp);
+	unlink(tpath);
+ done:
+	free(tpath);
+	return ret;
+}
+
+/*
+ * Time reads of REPACK_READ bytes at the given offsets of the database
+ * at path into *usec, per read.  The database is opened afresh with a
+ * cache of one chunk, so that nearly every read inflates.
+ */
+static int
+repack_time(const char *path, const size_t *offs, size_t n, size_t len,
+    double *usec)
+{
+	struct dc_database db;
+	struct dc_index_entry e;
+	struct timespec t0, t1;
+	char buf[REPACK_READ];
+	size_t i;
+	int ret = -1;
+
+	if (database_open((char *)path, &db) == -1)
+		return -1;
+	database_cache(&db, 1);
+	e.def_len = MINIMUM(len, sizeof(buf));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		e.def_off = offs[i];
+		if (database_lookup(&e, &db, buf) == -1)
+			goto done;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	*usec = ((t1.tv_sec - t0.tv_sec) * 1e6 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1e3) / MAXIMUM(n, 1);
+	ret = 0;
+ done:
+	database_close(&db);
+	return ret;
+}
+
+/*
+ * Rewrite db to path in chunks of clen bytes deflated at level, and
+ * time random reads of the old and the new file into r.  The old file
+ * is replaced if path is the one db was opened from.
+ */
+int
+repack(struct dc_database *db, const char *path, size_t clen, int level,
+    struct dc_pool *pool, struct dc_repack *r)
+{
+	struct repack_job job;
+	size_t offs[REPACK_SAMPLES], i;
+	u_int nworkers = pool_size(pool), w = 0;
+	int ret = -1;
+
+	memset(&job, 0, sizeof(job));
+	if (clen == 0 || clen > UINT16_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((job.text = database_text(db, pool, &job.len)) == NULL)
+		return -1;
+	job.clen = clen;
+	job.nchunks = MAXIMUM(1, (job.len + clen - 1) / clen);
+
+	if ((job.streams = calloc(nworkers, sizeof(*job.streams))) == NULL)
+		return -1;
+	for (w = 0; w < nworkers; w++)
+		if (deflateInit2(&job.streams[w], level, Z_DEFLATED,
+		    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			goto done;
+	/* room for the marker of the full flush */
+	job.bound = deflateBound(&job.streams[0], clen) + 16;
+	if ((job.out = reallocarray(NULL, job.nchunks, job.bound)) == NULL ||
+	    (job.sizes = calloc(job.nchunks, sizeof(*job.sizes))) == NULL ||
+	    (job.crcs = calloc(job.nchunks, sizeof(*job.crcs))) == NULL)
+		goto done;
+
+	pool_run(pool, repack_work, &job, job.nchunks);
+	for (i = 0; i < job.nchunks; i++) {
+		if (job.sizes[i] == 0) {
+			errno = EIO;
+			goto done;
+		}
+		if (job.sizes[i] > UINT16_MAX) {
+			errno = EFBIG;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < REPACK_SAMPLES; i++)
+		offs[i] = job.len > REPACK_READ ?
+		    arc4random_uniform(MINIMUM(job.len - REPACK_READ,
+		    UINT32_MAX)) : 0;
+	r->r_text = job.len;
+	r->r_chunks = job.nchunks;
+	if (repack_time(db->path, offs, REPACK_SAMPLES, job.len,
+	    &r->r_usec_old) == -1)
+		goto done;
+
+	if (repack_write(path, &job, level, &r->r_size) == -1)
+		goto done;
+	ret = repack_time(path, offs, REPACK_SAMPLES, job.len,
+	    &r->r_usec_new);
+
+ done:
+	while (w-- > 0)
+		deflateEnd(&job.streams[w]);
+	free(job.streams);
+	free(job.out);
+	free(job.sizes);
+	free(job.crcs);
+	return ret;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+struct dc_pool;
+
+/* what a repack produced, and random reads before and after */
+struct dc_repack {
+	size_t		 r_text;	/* inflated length */
+	size_t		 r_chunks;
+	off_t		 r_size;	/* of the new file */
+	double		 r_usec_old;	/* per read of REPACK_READ bytes */
+	double		 r_usec_new;
+};
+
+#define REPACK_READ	200		/* a typical definition */
+
+int repack(struct dc_database *, const char *, size_t, int,
+    struct dc_pool *, struct dc_repack *);
@@ -0,0 +1,835 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A small DICT (RFC 2229) server answering DEFINE, MATCH and SHOW from
+ * the databases opened at startup.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "dict.h"
+#include "database.h"
+#include "index.h"
+#include "server.h"
+
+#define SERVER_LINE_MAX	1024	/* RFC 2229 2.2 */
+#define SERVER_ARGS_MAX	8
+#define SERVER_COMPLETE	10	/* completions by default */
+#define SERVER_COMPLETE_MAX	1000
+
+struct client {
+	int			 c_fd;
+	char			 c_ibuf[SERVER_LINE_MAX];
+	size_t			 c_ilen;
+	char			*c_obuf;
+	size_t			 c_ooff;	/* already written */
+	size_t			 c_olen;	/* queued */
+	size_t			 c_osize;
+	int			 c_quit;	/* close once drained */
+	struct dc_complete	*c_complete;	/* the last COMPLETE */
+	struct dc_database	*c_complete_db;
+	TAILQ_ENTRY(client)	 c_entry;
+};
+TAILQ_HEAD(client_list, client);
+
+struct client_stuff {
+	struct client		*cs_c;
+	int			 cs_bol;	/* at the start of a line */
+};
+
+static ssize_t	server_exact(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+static ssize_t	server_prefix(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+static ssize_t	server_lev(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+static ssize_t	server_re(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+static ssize_t	server_glob(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+static ssize_t	server_substring(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+static ssize_t	server_suffix(struct dc_server *, struct dc_database *,
+		    const char *, struct dc_index_list *);
+
+static const struct strategy {
+	const char	*name;
+	const char	*desc;
+	ssize_t		(*find)(struct dc_server *, struct dc_database *,
+			    const char *, struct dc_index_list *);
+} strategies[] = {
+	{ "exact",	"Match headwords exactly",	server_exact },
+	{ "prefix",	"Match prefixes",		server_prefix },
+	{ "lev",	"Match headwords within Levenshtein distance",
+							server_lev },
+	{ "substring",	"Match substring occurring anywhere in a headword",
+							server_substring },
+	{ "suffix",	"Match suffixes",		server_suffix },
+	{ "re",		"POSIX extended regular expressions",	server_re },
+	{ "glob",	"Shell globs",			server_glob },
+};
+#define NSTRATEGIES		(sizeof(strategies) / sizeof(strategies[0]))
+#define STRATEGY_DEFAULT	1	/* "." */
+
+static struct client_list clients = TAILQ_HEAD_INITIALIZER(clients);
+static size_t nclients;
+static unsigned int msgid;
+
+static void client_append(struct client *, const char *, size_t);
+static void client_printf(struct client *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
+
+int
+server_listen(struct dc_server *srv, const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int error, fd, on = 1, r = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(host, port, &hints, &res)) != 0) {
+		warnx("%s: %s", host == NULL ? "*" : host, gai_strerror(error));
+		return -1;
+	}
+
+	for (ai = res; ai != NULL && srv->nfds < SERVER_LISTEN_MAX;
+	    ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+		    ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+		    sizeof(on)) == -1 ||
+		    bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+		    listen(fd, 16) == -1) {
+			close(fd);
+			continue;
+		}
+		srv->fds[srv->nfds++] = fd;
+		r = 0;
+	}
+	freeaddrinfo(res);
+
+	return r;
+}
+
+int
+server_listen_unix(struct dc_server *srv, const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (srv->nfds == SERVER_LISTEN_MAX) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		return -1;
+	(void)unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(fd, 16) == -1) {
+		close(fd);
+		return -1;
+	}
+	srv->fds[srv->nfds++] = fd;
+
+	return 0;
+}
+
+static void
+client_append(struct client *c, const char *buf, size_t len)
+{
+	char *p;
+	size_t size;
+
+	if (c->c_olen + len > c->c_osize) {
+		size = MAXIMUM(c->c_osize * 2, c->c_olen + len);
+		if ((p = realloc(c->c_obuf, size)) == NULL)
+			err(1, "realloc");
+		c->c_obuf = p;
+		c->c_osize = size;
+	}
+	memcpy(c->c_obuf + c->c_olen, buf, len);
+	c->c_olen += len;
+}
+
+static void
+client_printf(struct client *c, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	int len;
+
+	va_start(ap, fmt);
+	if ((len = vasprintf(&buf, fmt, ap)) == -1)
+		err(1, "vasprintf");
+	va_end(ap);
+	client_append(c, buf, len);
+	free(buf);
+}
+
+/*
+ * Send text with CRLF line endings and leading dots doubled.  The text
+ * may arrive in pieces, cs_bol tracks whether a line is about to start.
+ */
+static int
+client_stuff(void *arg, const char *buf, size_t len)
+{
+	struct client_stuff *cs = arg;
+	const char *end = buf + len, *nl;
+	size_t l;
+
+	while (buf < end) {
+		if (cs->cs_bol && buf[0] == '.')
+			client_append(cs->cs_c, ".", 1);
+		nl = memchr(buf, '\n', end - buf);
+		l = (nl == NULL ? end : nl) - buf;
+		client_append(cs->cs_c, buf, l);
+		if ((cs->cs_bol = nl != NULL))
+			client_append(cs->cs_c, "\r\n", 2);
+		buf += l + (nl != NULL);
+	}
+	return 0;
+}
+
+/*
+ * Finish the text with the terminating dot line.
+ */
+static void
+client_stuff_end(struct client_stuff *cs)
+{
+	if (!cs->cs_bol)
+		client_append(cs->cs_c, "\r\n", 2);
+	client_append(cs->cs_c, ".\r\n", 3);
+}
+
+static void
+client_text(struct client *c, const char *buf, size_t len)
+{
+	struct client_stuff cs;
+
+	cs.cs_c = c;
+	cs.cs_bol = 1;
+	client_stuff(&cs, buf, len);
+	client_stuff_end(&cs);
+}
+
+/*
+ * Split a command line into words, honouring single and double quotes
+ * and backslash escapes inside them.
+ */
+static int
+server_args(char *line, char **argv, int max)
+{
+	char *p = line, *w, q;
+	int argc = 0;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0')
+			return argc;
+		if (argc == max)
+			return -1;
+
+		argv[argc++] = w = p;
+		if (*p == '"' || *p == '\'') {
+			q = *p++;
+			while (*p != q) {
+				if (*p == '\0')
+					return -1;
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				*w++ = *p++;
+			}
+			p++;
+		} else {
+			while (*p != '\0' && *p != ' ' && *p != '\t')
+				*w++ = *p++;
+		}
+
+		if (*p != '\0' && *p != ' ' && *p != '\t')
+			return -1;
+		if (*p != '\0')
+			p++;
+		*w = '\0';
+	}
+}
+
+static int
+server_db_selected(const char *name, const struct dc_database *db)
+{
+	return strcmp(name, "*") == 0 || strcmp(name, "!") == 0 ||
+	    strcmp(name, db->name) == 0;
+}
+
+static int
+server_db_valid(struct dc_server *srv, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < srv->ndbs; i++)
+		if (server_db_selected(name, &srv->dbs[i]))
+			return 1;
+	return 0;
+}
+
+static char *
+server_lower(const char *word)
+{
+	char *p, *lookup;
+
+	if ((lookup = strdup(word)) == NULL)
+		err(1, "strdup");
+	for (p = lookup; *p != '\0'; p++)
+		*p = tolower((unsigned char)*p);
+	return lookup;
+}
+
+/*
+ * Count the definitions first, the 150 reply has to announce them.
+ */
+static void
+server_define(struct dc_server *srv, struct client *c, const char *dbname,
+    const char *word)
+{
+	struct client_stuff cs;
+	struct dc_database *db;
+	struct dc_index_entry e;
+	struct dc_cursor cur;
+	char *lookup;
+	size_t i, n = 0, r;
+	int pass, error = 0;
+
+	if (!server_db_valid(srv, dbname)) {
+		client_printf(c, "550 invalid database\r\n");
+		return;
+	}
+	lookup = server_lower(word);
+
+	for (pass = 0; pass < 2 && !error; pass++) {
+		if (pass == 1) {
+			if (n == 0)
+				break;
+			client_printf(c, "150 %zu definitions retrieved\r\n",
+			    n);
+		}
+		for (i = 0; i < srv->ndbs; i++) {
+			db = &srv->dbs[i];
+			if (!server_db_selected(dbname, db))
+				continue;
+			if (pass == 0) {
+				if ((r = index_exact_count(lookup,
+				    &db->index)) == 0)
+					continue;
+				n += r;
+			} else if (index_exact_cursor(lookup, &db->index,
+			    &cur) == -1)
+				continue;
+			while (pass == 1 && !error &&
+			    index_cursor_next(&cur, &e)) {
+				client_printf(c, "151 \"%.*s\" %s \"%s\"\r\n",
+				    e.match_len, e.match, db->name, db->name);
+				cs.cs_c = c;
+				cs.cs_bol = 1;
+				/* end the text cut short, then fail */
+				if (database_read(&e, db, client_stuff,
+				    &cs) == -1)
+					error = 1;
+				client_stuff_end(&cs);
+			}
+			if (error || strcmp(dbname, "!") == 0)
+				break;
+		}
+	}
+	free(lookup);
+
+	if (error)
+		client_printf(c, "420 cannot read definition\r\n");
+	else if (n == 0)
+		client_printf(c, "552 no match\r\n");
+	else
+		client_printf(c, "250 ok\r\n");
+}
+
+static ssize_t
+server_exact(struct dc_server *srv, struct dc_database *db, const char *word,
+    struct dc_index_list *l)
+{
+	return index_exact_find(word, &db->index, 0, 0, srv->arena, l);
+}
+
+static ssize_t
+server_prefix(struct dc_server *srv, struct dc_database *db, const char *word,
+    struct dc_index_list *l)
+{
+	return index_prefix_find(word, &db->index, NULL, 0, 0, srv->arena, l);
+}
+
+static ssize_t
+server_lev(struct dc_server *srv, struct dc_database *db, const char *word,
+    struct dc_index_list *l)
+{
+	return index_lev_find(word, &db->index, srv->lev_max, srv->pool,
+	    srv->arena, l);
+}
+
+static ssize_t
+server_substring(struct dc_server *srv, struct dc_database *db,
+    const char *word, struct dc_index_list *l)
+{
+	return index_substring_find(word, &db->index, srv->arena, l);
+}
+
+static ssize_t
+server_suffix(struct dc_server *srv, struct dc_database *db, const char *word,
+    struct dc_index_list *l)
+{
+	return index_suffix_find(word, &db->index, srv->arena, l);
+}
+
+/*
+ * A bad pattern matches nothing.
+ */
+static ssize_t
+server_re(struct dc_server *srv, struct dc_database *db, const char *word,
+    struct dc_index_list *l)
+{
+	ssize_t r;
+
+	if ((r = index_re_find(word, &db->index, srv->arena, l)) == -1 &&
+	    errno == EINVAL)
+		return 0;
+	return r;
+}
+
+static ssize_t
+server_glob(struct dc_server *srv, struct dc_database *db, const char *word,
+    struct dc_index_list *l)
+{
+	return index_glob_find(word, &db->index, srv->arena, l);
+}
+
+/*
+ * Return the number of distinct headwords in l, printing them if c is
+ * given.  Equal headwords are adjacent in every strategy.
+ */
+static size_t
+server_match_db(struct client *c, struct dc_database *db,
+    struct dc_index_list *l)
+{
+	struct dc_index_entry *e, *prev = NULL;
+	size_t n = 0;
+
+	SLIST_FOREACH(e, l, entries) {
+		if (prev != NULL && prev->match_len == e->match_len &&
+		    strncmp(prev->match, e->match, e->match_len) == 0)
+			continue;
+		if (c != NULL)
+			client_printf(c, "%s \"%.*s\"\r\n", db->name,
+			    e->match_len, e->match);
+		prev = e;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * The matches of every database are kept until all are counted, the 152
+ * reply has to announce them.
+ */
+static void
+server_match(struct dc_server *srv, struct client *c, const char *dbname,
+    const char *strat, const char *word)
+{
+	const struct strategy *st = NULL;
+	struct dc_index_list *lists;
+	struct dc_database *db;
+	char *lookup;
+	size_t i, n = 0;
+
+	if (!server_db_valid(srv, dbname)) {
+		client_printf(c, "550 invalid database\r\n");
+		return;
+	}
+	if (strcmp(strat, ".") == 0)
+		st = &strategies[STRATEGY_DEFAULT];
+	for (i = 0; st == NULL && i < NSTRATEGIES; i++)
+		if (strcasecmp(strat, strategies[i].name) == 0)
+			st = &strategies[i];
+	if (st == NULL) {
+		client_printf(c, "551 invalid strategy\r\n");
+		return;
+	}
+	lookup = server_lower(word);
+
+	arena_reset(srv->arena);
+	lists = arena_alloc(srv->arena, MAXIMUM(srv->ndbs, 1) * sizeof(*lists));
+	if (lists == NULL)
+		err(1, "arena_alloc");
+	/* "!" may stop early, leave the rest empty */
+	for (i = 0; i < srv->ndbs; i++)
+		SLIST_INIT(&lists[i]);
+	for (i = 0; i < srv->ndbs; i++) {
+		db = &srv->dbs[i];
+		if (!server_db_selected(dbname, db))
+			continue;
+		if (st->find(srv, db, lookup, &lists[i]) == -1)
+			err(1, "%s", st->name);
+		if (SLIST_EMPTY(&lists[i]))
+			continue;
+		n += server_match_db(NULL, db, &lists[i]);
+		if (strcmp(dbname, "!") == 0)
+			break;
+	}
+	free(lookup);
+
+	if (n == 0) {
+		client_printf(c, "552 no match\r\n");
+		return;
+	}
+	client_printf(c, "152 %zu matches found\r\n", n);
+	for (i = 0; i < srv->ndbs; i++)
+		if (!SLIST_EMPTY(&lists[i]))
+			server_match_db(c, &srv->dbs[i], &lists[i]);
+	client_append(c, ".\r\n", 3);
+	client_printf(c, "250 ok\r\n");
+}
+
+/*
+ * Send the first few distinct headwords starting with word.  The client
+ * keeps its session while it completes in the same database, so every
+ * keystroke only narrows the range of the one before.
+ */
+static void
+server_complete(struct dc_server *srv, struct client *c, const char *dbname,
+    const char *word, const char *count)
+{
+	struct dc_database *db = NULL;
+	struct dc_index_entry *e, *prev = NULL, *last = NULL;
+	struct dc_index_list l;
+	struct dc_cursor cur;
+	const char *errstr;
+	char *lookup;
+	size_t i, limit = SERVER_COMPLETE, n = 0;
+
+	for (i = 0; i < srv->ndbs && db == NULL; i++)
+		if (strcmp(dbname, srv->dbs[i].name) == 0)
+			db = &srv->dbs[i];
+	if (db == NULL) {
+		client_printf(c, "550 invalid database\r\n");
+		return;
+	}
+	if (count != NULL) {
+		limit = strtonum(count, 1, SERVER_COMPLETE_MAX, &errstr);
+		if (errstr != NULL) {
+			client_printf(c,
+			    "501 syntax error, illegal parameters\r\n");
+			return;
+		}
+	}
+	if (c->c_complete_db != db) {
+		index_complete_close(c->c_complete);
+		c->c_complete_db = NULL;
+		if ((c->c_complete = index_complete_open(&db->index)) == NULL)
+			err(1, "index_complete_open");
+		c->c_complete_db = db;
+	}
+
+	lookup = server_lower(word);
+	if (index_complete(c->c_complete, lookup, &cur) == -1)
+		err(1, "index_complete");
+	free(lookup);
+
+	arena_reset(srv->arena);
+	SLIST_INIT(&l);
+	while (n < limit) {
+		if ((e = arena_alloc(srv->arena, sizeof(*e))) == NULL)
+			err(1, "arena_alloc");
+		if (index_cursor_next(&cur, e) == NULL)
+			break;
+		if (prev != NULL && prev->match_len == e->match_len &&
+		    strncmp(prev->match, e->match, e->match_len) == 0)
+			continue;
+		if (last == NULL)
+			SLIST_INSERT_HEAD(&l, e, entries);
+		else
+			SLIST_INSERT_AFTER(last, e, entries);
+		prev = last = e;
+		n++;
+	}
+
+	if (n == 0) {
+		client_printf(c, "552 no match\r\n");
+		return;
+	}
+	client_printf(c, "152 %zu matches found\r\n", n);
+	server_match_db(c, db, &l);
+	client_append(c, ".\r\n", 3);
+	client_printf(c, "250 ok\r\n");
+}
+
+static void
+server_show(struct dc_server *srv, struct client *c, const char *what)
+{
+	size_t i;
+
+	if (strcasecmp(what, "DB") == 0 || strcasecmp(what, "DATABASES") == 0) {
+		if (srv->ndbs == 0) {
+			client_printf(c, "554 no databases present\r\n");
+			return;
+		}
+		client_printf(c, "110 %zu databases present\r\n", srv->ndbs);
+		for (i = 0; i < srv->ndbs; i++)
+			client_printf(c, "%s \"%s\"\r\n", srv->dbs[i].name,
+			    srv->dbs[i].name);
+	} else if (strcasecmp(what, "STRAT") == 0 ||
+	    strcasecmp(what, "STRATEGIES") == 0) {
+		client_printf(c, "111 %zu strategies available\r\n",
+		    NSTRATEGIES);
+		for (i = 0; i < NSTRATEGIES; i++)
+			client_printf(c, "%s \"%s\"\r\n", strategies[i].name,
+			    strategies[i].desc);
+	} else {
+		client_printf(c, "501 syntax error, illegal parameters\r\n");
+		return;
+	}
+	client_append(c, ".\r\n", 3);
+	client_printf(c, "250 ok\r\n");
+}
+
+static void
+server_command(struct dc_server *srv, struct client *c, char *line)
+{
+	static const char help[] =
+	    "DEFINE database word\n"
+	    "MATCH database strategy word\n"
+	    "COMPLETE database prefix [count]\n"
+	    "SHOW DB\n"
+	    "SHOW STRAT\n"
+	    "CLIENT info\n"
+	    "STATUS\n"
+	    "HELP\n"
+	    "QUIT\n";
+	char *argv[SERVER_ARGS_MAX];
+	int argc;
+
+	if ((argc = server_args(line, argv, SERVER_ARGS_MAX)) == -1) {
+		client_printf(c, "501 syntax error, illegal parameters\r\n");
+		return;
+	}
+	if (argc == 0)
+		return;
+
+	if (strcasecmp(argv[0], "DEFINE") == 0 && argc == 3)
+		server_define(srv, c, argv[1], argv[2]);
+	else if (strcasecmp(argv[0], "MATCH") == 0 && argc == 4)
+		server_match(srv, c, argv[1], argv[2], argv[3]);
+	else if (strcasecmp(argv[0], "COMPLETE") == 0 &&
+	    (argc == 3 || argc == 4))
+		server_complete(srv, c, argv[1], argv[2],
+		    argc == 4 ? argv[3] : NULL);
+	else if (strcasecmp(argv[0], "SHOW") == 0 && argc == 2)
+		server_show(srv, c, argv[1]);
+	else if (strcasecmp(argv[0], "CLIENT") == 0)
+		client_printf(c, "250 ok\r\n");
+	else if (strcasecmp(argv[0], "STATUS") == 0)
+		client_printf(c, "210 status %zu databases, %zu clients\r\n",
+		    srv->ndbs, nclients);
+	else if (strcasecmp(argv[0], "HELP") == 0) {
+		client_printf(c, "113 help text follows\r\n");
+		client_text(c, help, sizeof(help) - 1);
+		client_printf(c, "250 ok\r\n");
+	} else if (strcasecmp(argv[0], "QUIT") == 0) {
+		client_printf(c, "221 bye\r\n");
+		c->c_quit = 1;
+	} else if (strcasecmp(argv[0], "DEFINE") == 0 ||
+	    strcasecmp(argv[0], "MATCH") == 0 ||
+	    strcasecmp(argv[0], "COMPLETE") == 0 ||
+	    strcasecmp(argv[0], "SHOW") == 0)
+		client_printf(c, "501 syntax error, illegal parameters\r\n");
+	else
+		client_printf(c, "500 unknown command\r\n");
+}
+
+static void
+server_accept(int lfd)
+{
+	struct client *c;
+	int fd;
+
+	if ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+		if (errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED)
+			warn("accept");
+		return;
+	}
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		warn("calloc");
+		close(fd);
+		return;
+	}
+	c->c_fd = fd;
+	TAILQ_INSERT_TAIL(&clients, c, c_entry);
+	nclients++;
+
+	client_printf(c, "220 dict <> <%ld.%u@dict>\r\n", (long)getpid(),
+	    msgid++);
+}
+
+static void
+client_close(struct client *c)
+{
+	TAILQ_REMOVE(&clients, c, c_entry);
+	nclients--;
+	close(c->c_fd);
+	index_complete_close(c->c_complete);
+	free(c->c_obuf);
+	free(c);
+}
+
+static int
+client_read(struct dc_server *srv, struct client *c)
+{
+	char *nl;
+	ssize_t n;
+	size_t len;
+
+	n = read(c->c_fd, c->c_ibuf + c->c_ilen, sizeof(c->c_ibuf) - c->c_ilen);
+	if (n == -1)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if (n == 0)
+		return -1;
+	c->c_ilen += n;
+
+	while (!c->c_quit &&
+	    (nl = memchr(c->c_ibuf, '\n', c->c_ilen)) != NULL) {
+		*nl = '\0';
+		if (nl > c->c_ibuf && nl[-1] == '\r')
+			nl[-1] = '\0';
+		server_command(srv, c, c->c_ibuf);
+		len = nl + 1 - c->c_ibuf;
+		memmove(c->c_ibuf, nl + 1, c->c_ilen - len);
+		c->c_ilen -= len;
+	}
+	if (c->c_ilen == sizeof(c->c_ibuf)) {
+		client_printf(c, "500 line too long\r\n");
+		c->c_ilen = 0;
+	}
+
+	return 0;
+}
+
+static int
+client_write(struct client *c)
+{
+	ssize_t n;
+
+	n = write(c->c_fd, c->c_obuf + c->c_ooff, c->c_olen - c->c_ooff);
+	if (n == -1)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	c->c_ooff += n;
+	if (c->c_ooff == c->c_olen) {
+		c->c_ooff = c->c_olen = 0;
+		if (c->c_quit)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A client is only read from once its replies have been written, which
+ * keeps a slow reader from making the server queue unbounded output.
+ */
+void
+server_loop(struct dc_server *srv)
+{
+	struct pollfd *pfd = NULL, *p;
+	struct client *c, *tc;
+	size_t npfd, maxpfd = 0, i;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		npfd = srv->nfds + nclients;
+		if (npfd > maxpfd) {
+			if ((p = reallocarray(pfd, npfd, sizeof(*pfd))) == NULL)
+				err(1, "reallocarray");
+			pfd = p;
+			maxpfd = npfd;
+		}
+		for (i = 0; i < srv->nfds; i++) {
+			pfd[i].fd = srv->fds[i];
+			pfd[i].events = POLLIN;
+		}
+		TAILQ_FOREACH(c, &clients, c_entry) {
+			pfd[i].fd = c->c_fd;
+			pfd[i].events = c->c_olen ? POLLOUT : POLLIN;
+			i++;
+		}
+
+		if (poll(pfd, npfd, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		/* accepted clients go to the tail, after this walk */
+		i = srv->nfds;
+		TAILQ_FOREACH_SAFE(c, &clients, c_entry, tc) {
+			p = &pfd[i++];
+			if (p->revents & (POLLERR | POLLNVAL))
+				client_close(c);
+			else if ((p->revents & POLLOUT) && client_write(c) == -1)
+				client_close(c);
+			else if ((p->revents & (POLLIN | POLLHUP)) &&
+			    client_read(srv, c) == -1)
+				client_close(c);
+		}
+		for (i = 0; i < srv->nfds; i++)
+			if (pfd[i].revents & POLLIN)
+				server_accept(pfd[i].fd);
+	}
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define SERVER_LISTEN_MAX	16
+
+struct dc_arena;
+struct dc_pool;
+
+struct dc_server {
+	struct dc_database	*dbs;
+	size_t			 ndbs;
+	struct dc_arena		*arena;		/* per request results */
+	struct dc_pool		*pool;
+	u_int			 lev_max;	/* "lev" distance */
+	int			 fds[SERVER_LISTEN_MAX];
+	size_t			 nfds;
+};
+
+int server_listen(struct dc_server *, const char *, const char *);
+int server_listen_unix(struct dc_server *, const char *);
+__dead void server_loop(struct dc_server *);
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the syntax of the text index: every line is a headword, a tab,
+ * the base64 def_off, a tab and the base64 def_len.  The vector versions
+ * classify a block of bytes at once and only walk its tabs and newlines,
+ * a block they reject is redone by the scalar loop to find the offset.
+ */
+
+#include <sys/types.h>
+
+#if defined(__amd64__) || defined(__x86_64__)
+#include <immintrin.h>
+#define VALIDATE_X86
+#endif
+
+#include "validate.h"
+
+static inline int
+validate_delim(char c, struct dc_validate *v)
+{
+	if (c == '\t') {
+		if (v->v_tabs == 1 && v->v_b64chars > v->v_off_max)
+			return -1;
+		else if (v->v_tabs == 2 && v->v_b64chars > v->v_len_max)
+			return -1;
+		else if (v->v_b64chars == 0)
+			return -1;
+		v->v_tabs++;
+		v->v_b64chars = 0;
+		if (v->v_tabs > 2)
+			return -1;
+	} else {
+		if (v->v_tabs != 2)
+			return -1;
+		v->v_tabs = 0;
+	}
+	return 0;
+}
+
+/*
+ * Return the offset of the first byte that is wrong, or -1.
+ */
+off_t
+validate_scalar(const char *data, off_t size, struct dc_validate *v)
+{
+	off_t i;
+	char c;
+
+	for (i = 0; i < size; i++) {
+		c = data[i];
+		if (c == '\t' || c == '\n') {
+			if (validate_delim(c, v) == -1)
+				return i;
+		} else if (v->v_tabs) {
+			if ((c != '+' && c < '/') || (c > '9' && c < 'A')
+			    || (c > 'Z' && c < 'a') || (c > 'z'))
+				return i;
+			v->v_b64chars++;
+		}
+	}
+	return -1;
+}
+
+#ifdef VALIDATE_X86
+/*
+ * Walk a block of width bytes given the bit masks of its tabs and
+ * newlines and of its bytes outside the base64 alphabet.
+ */
+static inline int
+validate_masks(const char *p, u_int32_t delim, u_int32_t bad, int width,
+    struct dc_validate *v)
+{
+	u_int32_t all, seg;
+	int j, pos = 0;
+
+	all = width == 32 ? 0xffffffffU : (1U << width) - 1;
+	while (delim != 0) {
+		j = __builtin_ctz(delim);
+		if (v->v_tabs) {
+			seg = ((1U << j) - 1) & ~((1U << pos) - 1);
+			if (bad & seg)
+				return -1;
+			v->v_b64chars += j - pos;
+		}
+		if (validate_delim(p[j], v) == -1)
+			return -1;
+		pos = j + 1;
+		delim &= delim - 1;
+	}
+	if (v->v_tabs && pos < width) {
+		seg = all & ~((1U << pos) - 1);
+		if (bad & seg)
+			return -1;
+		v->v_b64chars += width - pos;
+	}
+	return 0;
+}
+
+static off_t
+validate_tail(const char *data, off_t i, off_t size, struct dc_validate *v)
+{
+	off_t r;
+
+	r = validate_scalar(data + i, size - i, v);
+	return r == -1 ? -1 : i + r;
+}
+
+#define IN_RANGE128(x, lo, hi)						\
+	_mm_and_si128(_mm_cmpgt_epi8((x), _mm_set1_epi8((lo) - 1)),	\
+	    _mm_cmplt_epi8((x), _mm_set1_epi8((hi) + 1)))
+
+static off_t
+validate_sse2(const char *data, off_t size, struct dc_validate *v)
+{
+	struct dc_validate save;
+	__m128i x, b64;
+	u_int32_t delim, bad;
+	off_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(data + i));
+		delim = _mm_movemask_epi8(_mm_or_si128(
+		    _mm_cmpeq_epi8(x, _mm_set1_epi8('\t')),
+		    _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'))));
+		b64 = _mm_or_si128(_mm_or_si128(IN_RANGE128(x, 'A', 'Z'),
+		    IN_RANGE128(x, 'a', 'z')), _mm_or_si128(
+		    IN_RANGE128(x, '/', '9'),
+		    _mm_cmpeq_epi8(x, _mm_set1_epi8('+'))));
+		bad = ~_mm_movemask_epi8(b64) & 0xffff;
+
+		save = *v;
+		if (validate_masks(data + i, delim, bad, 16, v) == -1) {
+			*v = save;
+			break;
+		}
+	}
+	return validate_tail(data, i, size, v);
+}
+
+#define IN_RANGE256(x, lo, hi)						\
+	_mm256_and_si256(_mm256_cmpgt_epi8((x),				\
+	    _mm256_set1_epi8((lo) - 1)),				\
+	    _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), (x)))
+
+__attribute__((target("avx2")))
+static off_t
+validate_avx2(const char *data, off_t size, struct dc_validate *v)
+{
+	struct dc_validate save;
+	__m256i x, b64;
+	u_int32_t delim, bad;
+	off_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(data + i));
+		delim = _mm256_movemask_epi8(_mm256_or_si256(
+		    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t')),
+		    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'))));
+		b64 = _mm256_or_si256(_mm256_or_si256(
+		    IN_RANGE256(x, 'A', 'Z'), IN_RANGE256(x, 'a', 'z')),
+		    _mm256_or_si256(IN_RANGE256(x, '/', '9'),
+		    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('+'))));
+		bad = ~(u_int32_t)_mm256_movemask_epi8(b64);
+
+		save = *v;
+		if (validate_masks(data + i, delim, bad, 32, v) == -1) {
+			*v = save;
+			break;
+		}
+	}
+	return validate_tail(data, i, size, v);
+}
+#endif /* VALIDATE_X86 */
+
+/*
+ * Same result as validate_scalar(), using the widest vector unit the
+ * CPU has.
+ */
+off_t
+validate_text(const char *data, off_t size, struct dc_validate *v)
+{
+#ifdef VALIDATE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return validate_avx2(data, size, v);
+	return validate_sse2(data, size, v);
+#else
+	return validate_scalar(data, size, v);
+#endif
+}
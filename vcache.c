@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2023 Moritz Buhl <mbuhl@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Remember databases that passed index_validate().  The key is the
+ * identity of the index and dictionary files, the limit on def_off and
+ * a hash over samples of the index, its sidecar records and the gzip
+ * header, so a changed file is validated again.
+ *
+ * The inflated text of a dictionary is kept here too, behind a header
+ * naming the identity of the dictionary it came from.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dict.h"
+#include "database.h"
+#include "index.h"
+#include "vcache.h"
+
+#define VCACHE_MAGIC	"DCVALID"
+#define VCACHE_SAMPLES	16		/* evenly spaced blocks */
+#define VCACHE_BLOCK	4096
+#define VCACHE_EDGE	(64 * 1024)	/* head and tail */
+#define VCACHE_TEXT_MAGIC "DCTEXT"
+#define VCACHE_TEXT_HDR	4096		/* the text starts page aligned */
+
+struct vcache_key {
+	char		k_magic[8];
+	u_int64_t	k_idx_dev;
+	u_int64_t	k_idx_ino;
+	int64_t		k_idx_size;
+	int64_t		k_idx_mtime;
+	int64_t		k_idx_mtime_ns;
+	u_int64_t	k_db_dev;
+	u_int64_t	k_db_ino;
+	int64_t		k_db_size;
+	int64_t		k_db_mtime;
+	int64_t		k_db_mtime_ns;
+	int64_t		k_db_span;	/* bounds def_off */
+	u_int64_t	k_nrecs;
+	u_int64_t	k_nsa;
+	u_int64_t	k_nph;
+	u_int64_t	k_ntrie;
+	u_int64_t	k_neyt;
+	u_int64_t	k_hash;
+};
+
+struct vcache_text {
+	char		t_magic[8];
+	u_int64_t	t_dev;
+	u_int64_t	t_ino;
+	int64_t		t_size;
+	int64_t		t_mtime;
+	int64_t		t_mtime_ns;
+	u_int64_t	t_len;
+};
+
+static char *vcache_dir;
+
+static u_int64_t
+vcache_fnv(u_int64_t h, const void *buf, size_t len)
+{
+	const u_char *p = buf;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static u_int64_t
+vcache_sample(u_int64_t h, const char *buf, size_t len)
+{
+	size_t i, off;
+
+	if (len <= 2 * VCACHE_EDGE + VCACHE_SAMPLES * VCACHE_BLOCK)
+		return vcache_fnv(h, buf, len);
+
+	h = vcache_fnv(h, buf, VCACHE_EDGE);
+	for (i = 0; i < VCACHE_SAMPLES; i++) {
+		off = VCACHE_EDGE + (len - 2 * VCACHE_EDGE - VCACHE_BLOCK) /
+		    (VCACHE_SAMPLES - 1) * i;
+		h = vcache_fnv(h, buf + off, VCACHE_BLOCK);
+	}
+	return vcache_fnv(h, buf + len - VCACHE_EDGE, VCACHE_EDGE);
+}
+
+static void
+vcache_key(struct dc_database *db, struct vcache_key *k)
+{
+	const void *p;
+	size_t len;
+
+	memset(k, 0, sizeof(*k));
+	memcpy(k->k_magic, VCACHE_MAGIC, sizeof(k->k_magic));
+	k->k_idx_dev = db->index.ident.dev;
+	k->k_idx_ino = db->index.ident.ino;
+	k->k_idx_size = db->index.ident.size;
+	k->k_idx_mtime = db->index.ident.mtime.tv_sec;
+	k->k_idx_mtime_ns = db->index.ident.mtime.tv_nsec;
+	k->k_db_dev = db->ident.dev;
+	k->k_db_ino = db->ident.ino;
+	k->k_db_size = db->ident.size;
+	k->k_db_mtime = db->ident.mtime.tv_sec;
+	k->k_db_mtime_ns = db->ident.mtime.tv_nsec;
+	k->k_db_span = db->size;
+	k->k_nrecs = db->index.nrecs;
+	k->k_nsa = db->index.nsa;
+	k->k_nph = db->index.nph;
+	k->k_ntrie = db->index.ntrie;
+	k->k_neyt = db->index.neyt;
+
+	k->k_hash = 0xcbf29ce484222325ULL;
+	k->k_hash = vcache_sample(k->k_hash, db->index.data, db->index.size);
+	p = index_records(&db->index, &len);
+	k->k_hash = vcache_sample(k->k_hash, p, len);
+	p = index_suffixes(&db->index, &len);
+	k->k_hash = vcache_sample(k->k_hash, p, len);
+	p = index_hashes(&db->index, &len);
+	k->k_hash = vcache_sample(k->k_hash, p, len);
+	p = index_trie(&db->index, &len);
+	k->k_hash = vcache_sample(k->k_hash, p, len);
+	p = index_layout(&db->index, &len);
+	k->k_hash = vcache_sample(k->k_hash, p, len);
+	p = database_header(db, &len);
+	k->k_hash = vcache_fnv(k->k_hash, p, len);
+}
+
+static char *
+vcache_path(struct dc_database *db)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%llu.%llu", vcache_dir,
+	    (unsigned long long)db->index.ident.dev,
+	    (unsigned long long)db->index.ident.ino) == -1)
+		return NULL;
+	return path;
+}
+
+/*
+ * Create the cache directory, before unveil(2) hides it.  Returns it,
+ * or NULL if there is no cache.
+ */
+const char *
+vcache_init(void)
+{
+	const char *home;
+
+	if ((home = getenv("HOME")) == NULL || *home == '\0')
+		return NULL;
+	if (asprintf(&vcache_dir, "%s/.cache", home) == -1) {
+		vcache_dir = NULL;
+		return NULL;
+	}
+	if (mkdir(vcache_dir, 0700) == -1 && errno != EEXIST)
+		goto fail;
+	free(vcache_dir);
+	if (asprintf(&vcache_dir, "%s/.cache/dict", home) == -1) {
+		vcache_dir = NULL;
+		return NULL;
+	}
+	if (mkdir(vcache_dir, 0700) == -1 && errno != EEXIST)
+		goto fail;
+
+	return vcache_dir;
+ fail:
+	free(vcache_dir);
+	vcache_dir = NULL;
+	return NULL;
+}
+
+/*
+ * Return 0 if this database is known to be valid.
+ */
+int
+vcache_check(struct dc_database *db)
+{
+	struct vcache_key k, stored;
+	char *path;
+	ssize_t n;
+	int fd;
+
+	if (vcache_dir == NULL || (path = vcache_path(db)) == NULL)
+		return -1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return -1;
+	n = read(fd, &stored, sizeof(stored));
+	close(fd);
+	if (n != sizeof(stored))
+		return -1;
+
+	vcache_key(db, &k);
+	return memcmp(&k, &stored, sizeof(k)) == 0 ? 0 : -1;
+}
+
+/*
+ * Record a database that was just validated.  Failing to do so only
+ * means it is validated again next time.
+ */
+void
+vcache_store(struct dc_database *db)
+{
+	struct vcache_key k;
+	char *path, *tmp;
+	int fd;
+
+	if (vcache_dir == NULL || (path = vcache_path(db)) == NULL)
+		return;
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", path) == -1) {
+		free(path);
+		return;
+	}
+	vcache_key(db, &k);
+	if ((fd = mkstemp(tmp)) != -1) {
+		if (write(fd, &k, sizeof(k)) != sizeof(k)) {
+			close(fd);
+			unlink(tmp);
+		} else if (close(fd) == -1 || rename(tmp, path) == -1)
+			unlink(tmp);
+	}
+	free(tmp);
+	free(path);
+}
+
+static char *
+vcache_text_path(struct dc_database *db)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%llu.%llu.text", vcache_dir,
+	    (unsigned long long)db->ident.dev,
+	    (unsigned long long)db->ident.ino) == -1)
+		return NULL;
+	return path;
+}
+
+static void
+vcache_text_key(struct dc_database *db, struct vcache_text *t, size_t len)
+{
+	memset(t, 0, sizeof(*t));
+	memcpy(t->t_magic, VCACHE_TEXT_MAGIC, sizeof(VCACHE_TEXT_MAGIC));
+	t->t_dev = db->ident.dev;
+	t->t_ino = db->ident.ino;
+	t->t_size = db->ident.size;
+	t->t_mtime = db->ident.mtime.tv_sec;
+	t->t_mtime_ns = db->ident.mtime.tv_nsec;
+	t->t_len = len;
+}
+
+/*
+ * Map the saved text of this database, if there is one, and hand it to
+ * the database.  Returns 0 if it did.
+ */
+int
+vcache_text_load(struct dc_database *db)
+{
+	struct vcache_text t, stored;
+	struct stat sb;
+	char *path;
+	void *map;
+	int fd;
+
+	if (vcache_dir == NULL || (path = vcache_text_path(db)) == NULL)
+		return -1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 ||
+	    read(fd, &stored, sizeof(stored)) != sizeof(stored))
+		goto fail;
+	vcache_text_key(db, &t, stored.t_len);
+	if (memcmp(&t, &stored, sizeof(t)) != 0 ||
+	    sb.st_size < VCACHE_TEXT_HDR ||
+	    (u_int64_t)sb.st_size - VCACHE_TEXT_HDR != stored.t_len)
+		goto fail;
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	close(fd);
+
+	if (database_text_map(db, map, sb.st_size, VCACHE_TEXT_HDR,
+	    stored.t_len) == -1) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+	return 0;
+ fail:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Save the inflated text of a database for vcache_text_load().
+ * Failing to do so only means it is inflated again next time.
+ */
+void
+vcache_text_store(struct dc_database *db, const char *text, size_t len)
+{
+	struct vcache_text t;
+	char hdr[VCACHE_TEXT_HDR];
+	char *path, *tmp;
+	ssize_t n;
+	size_t off;
+	int fd;
+
+	if (vcache_dir == NULL || (path = vcache_text_path(db)) == NULL)
+		return;
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", path) == -1) {
+		free(path);
+		return;
+	}
+	vcache_text_key(db, &t, len);
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, &t, sizeof(t));
+	if ((fd = mkstemp(tmp)) == -1)
+		goto done;
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		goto fail;
+	for (off = 0; off < len; off += n)
+		if ((n = write(fd, text + off, len - off)) == -1)
+			goto fail;
+	if (close(fd) == -1 || rename(tmp, path) == -1)
+		unlink(tmp);
+	goto done;
+ fail:
+	close(fd);
+	unlink(tmp);
+ done:
+	free(tmp);
+	free(path);
+}